@@ -32,37 +32,12 @@ echo $(timestamp) Output file:  $OUTPUT_FILE >> $LOG_FILE
 echo $(timestamp) Log file:  $LOG_FILE >> $LOG_FILE
 
 ##################################
-#Run the parse data program which transforms input file into the binary file needed by the graph building program.
-##################################
-
-echo $(timestamp) Run parse_data.exe >> $LOG_FILE
-./parse_data.exe $INPUT_FILE >> $LOG_FILE
-#check return code
-OUT=$?
-if [ $OUT -eq 0 ]; then
-        echo "$(timestamp) Parse data program completed!  Output saved to tmp.dat" |tee -a $LOG_FILE
-else
-        echo "$(timestamp) Parse data program failed!  See log file:  $LOG_FILE" |tee -a $LOG_FILE
-	exit
-fi
-
-
-
-##################################
-#Prepare the parameters file for the graph program.
-##################################
-
-touch parameters
-echo input=./tmp.dat > parameters
-echo $OUTPUT_PARAM >> parameters
-echo phylogeny_structure_file=phylogeny_structure.txt >> parameters
-
-
-##################################
-#Run the graph program
+#Run the graph program straight on the read table.  It parses the table
+# itself, so no tmp.dat or parameters file is written and several runs can
+# share the working directory.
 ##################################
 echo $(timestamp) Run phylo_graph.exe >> $LOG_FILE
-./phylo_graph.exe params="parameters" 2>> $LOG_FILE
+./phylo_graph.exe input="$INPUT_FILE" input_format=table "$OUTPUT_PARAM" phylogeny_structure_file=phylogeny_structure.txt 2>> $LOG_FILE
 #check return code
 OUT=$?
 if [ $OUT -eq 0 ]; then
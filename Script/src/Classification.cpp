@@ -2,6 +2,9 @@
 #include "Classification.h"
 #include <iostream>
 #include <numeric>
+#include <sstream>
+#include "System.h"
+#include "DGNode.h"
 
 TreeNode::TreeNode(std::string label, int depth) : _label(label), _value(0.f), _depth(depth) {}
 TreeNode::TreeNode(std::string label, int depth, double value) : _label(label), _value(value), _depth(depth) {}
@@ -80,3 +83,247 @@ void TreeNode::UpdateValues()
 			}
 	);
 }
+
+//function to read lines from cross platform files.  handles Windows \n\r, UNIX \n, and early Mac \r
+std::istream& safeGetline(std::istream& is, std::string& t)
+{
+	t.clear();
+
+	// The characters in the stream are read one-by-one using a std::streambuf.
+	// That is faster than reading them one-by-one using the std::istream.
+	// Code that uses streambuf this way must be guarded by a sentry object.
+	// The sentry object performs various tasks,
+	// such as thread synchronization and updating the stream state.
+
+	std::istream::sentry se(is, true);
+	std::streambuf* sb = is.rdbuf();
+
+	for (;;) {
+		int c = sb->sbumpc();
+		switch (c) {
+		case '\n':
+			return is;
+		case '\r':
+			if (sb->sgetc() == '\n')
+				sb->sbumpc();
+			return is;
+		case EOF:
+			// Also handle the case when the last line has no line ending
+			if (t.empty())
+				is.setstate(std::ios::eofbit);
+			return is;
+		default:
+			t += (char)c;
+		}
+	}
+}
+
+void ReadClassifications(std::istream& in, std::vector<R16_read>& classifications, std::ostream& errors)
+{
+	//parse the data file, tokenizing each line into a vector of strings.
+	//parsing is based on tab delimiter
+	std::string delimiter = "\t";
+	for (std::string line; safeGetline(in, line);)
+	{
+		if (line.empty()) continue;
+
+		std::vector<std::string> tokens;
+		size_t pos = 0;
+		std::string token;
+		while ((pos = line.find(delimiter)))
+		{
+			if (pos == std::string::npos)
+			{
+				token = line;
+				tokens.push_back(token);
+				break;
+			}
+			else
+			{
+				token = line.substr(0, pos);
+				line.erase(0, pos + delimiter.length());
+				tokens.push_back(token);
+			}
+		}
+
+		//transform the string tokens into an R16_read classification
+		if (tokens.size() != 11)
+		{
+			errors << "Error, incorrect line length.  Expected 11 tokens but only received " << tokens.size() << std::endl;
+			errors << ">>>";
+			for (std::string s : tokens)
+			{
+				errors << s << ",";
+			}
+			errors << std::endl;
+			continue;
+		}
+		//each level (columns 4-10) needs its prefix, such as "g:", which is removed below
+		bool prefixed = true;
+		for (int i = 4; i < 11; ++i)
+		{
+			if (tokens[i].length() < 2)
+			{
+				prefixed = false;
+			}
+		}
+		if (!prefixed)
+		{
+			errors << "Error, classification level without its prefix." << std::endl;
+			errors << ">>>";
+			for (std::string s : tokens)
+			{
+				errors << s << ",";
+			}
+			errors << std::endl;
+			continue;
+		}
+		R16_read c;
+		//percentage of reads for this classification (second column in the file)
+		c.value = atof(tokens[1].c_str());
+		//get all levels of the classification
+		//classification level prefixes are removed (i.e. for "g:Streptococcus" the "g:" will be discarded and only "Streptococcus" will be saved.
+		c.classification.push_back(tokens[4].substr(2));	//kingdom
+		c.classification.push_back(tokens[5].substr(2));	//phylum
+		c.classification.push_back(tokens[6].substr(2));	//class
+		c.classification.push_back(tokens[7].substr(2));	//order
+		c.classification.push_back(tokens[8].substr(2));	//family
+		c.classification.push_back(tokens[9].substr(2));	//genus
+		c.classification.push_back(tokens[10].substr(2));	//species
+		classifications.push_back(c);
+	}
+}
+
+void FlattenTree(TreeNode& root, std::vector<std::vector<DGNode>>& levels)
+{
+	levels.clear();
+	levels.resize(8);
+	root.DepthFirst(
+		//pre-order function
+		[&levels](TreeNode& t)
+		{
+			Assert(t.GetDepth() < 8);
+			DGNode node;
+			node.count = t.GetValue();
+			node.num_children = t.GetChildren().size();
+			//first_child, if there are children, will be put one level down at the end of the vector
+			node.first_child = (node.num_children > 0) ? levels[t.GetDepth() + 1].size() : -1;
+			node.label = t.GetLabel();
+			//parent will be the last node in the vector one level up, the root has none
+			node.parent = (t.GetDepth() > 0) ? levels[t.GetDepth() - 1].size() - 1 : -1;
+			levels[t.GetDepth()].push_back(node);
+		},
+		//post-order function
+		[](TreeNode& t){ return; }
+	);
+}
+
+bool ReadLevels(std::istream& in, std::vector<std::vector<DGNode>>& levels)
+{
+	//nodes are added as they are read, so a count larger than the input only fails at its end
+	const int max_levels = 64;
+	const int max_label = 1 << 16;
+
+	int num_levels = -1;
+	in.read((char*)&num_levels, sizeof(num_levels));
+	if (!in || (num_levels < 0) || (num_levels > max_levels))
+		return false;
+	levels.assign(num_levels, std::vector<DGNode>());
+	for (int level = 0; level < num_levels; ++level)
+	{
+		int size = -1;
+		in.read((char*)&size, sizeof(size));
+		if (!in || (size < 0))
+			return false;
+		for (int i = 0; i < size; ++i)
+		{
+			int length = -1;
+			in.read((char*)&length, sizeof(length));
+			if (!in || (length < 0) || (length > max_label))
+				return false;
+			DGNode node;
+			node.label.resize(length);
+			if (length > 0)
+				in.read(&node.label[0], length);
+			ReadBin(in, node.count);
+			ReadBin(in, node.parent);
+			ReadBin(in, node.first_child);
+			ReadBin(in, node.num_children);
+			if (!in)
+				return false;
+			levels[level].push_back(node);
+		}
+	}
+	return true;
+}
+
+bool ValidateLevels(const std::vector<std::vector<DGNode>>& nodes, std::ostream& report)
+{
+	std::stringstream errStream;
+	bool valid = true;
+	int levels = nodes.size();
+	for (int level = 0; level < levels; ++level)
+	{
+		errStream << ">>>>>>>LEVEL:" << level << " (count=" << nodes[level].size() << ")" << std::endl;
+		for (int i = 0; i < nodes[level].size(); ++i)
+		{
+			int first_child = nodes[level][i].first_child;
+			errStream << "NODE[" << level << "," << i << "]" << "::" << nodes[level][i].label \
+					<< "::Parent[" << nodes[level][i].parent << "]::FirstChild[" << nodes[level][i].first_child \
+					<< "]::NumChildren[" << nodes[level][i].num_children << "]";
+			//check to see if the parent of this node is valid (valid is [parent > -1 && parent < the max index of the previous level])  -1 denotes a node with no parent
+			if(nodes[level][i].parent > -1 || (level > 0 && nodes[level][i].parent > nodes[level - 1].size() - 1))
+			{
+				errStream << "(Parent valid)" << std::endl;
+			}
+			else
+			{
+				errStream << "(Parent INVALID)" << std::endl;
+				//only set valid to false for invalid parent if we're not looking at the root level
+				valid = (level !=0) ? false : valid;
+			}
+			for (int child = 0; child < nodes[level][i].num_children; ++child)
+			{
+				int childIndex = first_child + child;
+				if(childIndex < 0
+						|| level + 1 >= levels
+						|| childIndex > nodes[level + 1].size() - 1
+						|| nodes[level + 1][childIndex].parent != i)
+				{
+					errStream << "Child::" << first_child + child << " (INVALID)" << std::endl;
+					valid = false;
+				}
+				else
+				{
+					errStream << "Child::" << first_child + child << " (valid)" << std::endl;
+				}
+
+			}
+		}
+	}
+
+#ifndef NDEBUG
+	report << errStream.str();
+#else
+	if(!valid) report << errStream.str();
+#endif
+
+	return valid;
+}
+
+bool ReadClassificationLevels(std::istream& in, std::vector<std::vector<DGNode>>& levels, std::ostream& log)
+{
+	std::vector<R16_read> classifications;
+	ReadClassifications(in, classifications, log);
+
+	//build the tree structure from the classifications
+	TreeNode root("", 0);
+	for (R16_read c : classifications)
+	{
+		root.Insert(c);
+	}
+	root.UpdateValues();
+
+	FlattenTree(root, levels);
+	return ValidateLevels(levels, log);
+}
@@ -12,6 +12,9 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <iostream>
+
+struct DGNode;
 
 struct R16_read
 {
@@ -67,5 +70,28 @@ private:
 	std::vector<TreeNode> _children;
 };
 
+//function to read lines from cross platform files.  handles Windows \n\r, UNIX \n, and early Mac \r
+std::istream& safeGetline(std::istream& is, std::string& t);
+
+//reads the tab delimited R16 read table (the columns are described in README.txt) into classifications.
+//lines without the expected 11 columns are reported to errors and skipped.
+void ReadClassifications(std::istream& in, std::vector<R16_read>& classifications, std::ostream& errors);
+
+//copies the tree into a 2d array of DGNode, one vector per level, which is the structure GraphPhylogeny draws from.
+//each node's children are stored together one level down, in the order they were inserted.
+void FlattenTree(TreeNode& root, std::vector<std::vector<DGNode>>& levels);
+
+//reads the levels as parse_data.exe writes them to tmp.dat, like Read(in, levels), but without trusting the sizes
+//in the input, so a damaged file or request fails instead of exhausting memory.  returns false if the input ends early.
+bool ReadLevels(std::istream& in, std::vector<std::vector<DGNode>>& levels);
+
+//validates the flattened hierarchy, comparing each DGNode's parent field with the parent's children fields.
+//the node by node report goes to report, always in debug builds and only if something is invalid otherwise.
+bool ValidateLevels(const std::vector<std::vector<DGNode>>& levels, std::ostream& report);
+
+//all of the above: reads a read table straight into the levels GraphPhylogeny draws from, so no tmp.dat is
+//needed in between.  returns false if the levels are invalid.
+bool ReadClassificationLevels(std::istream& in, std::vector<std::vector<DGNode>>& levels, std::ostream& log);
+
 
 #endif /* SRC_CLASSIFICATION_H_ */
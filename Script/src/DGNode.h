@@ -22,7 +22,7 @@ struct DGNode
 };
 
 template <>
-void Write<DGNode>(std::ostream &out, const DGNode &x)
+inline void Write<DGNode>(std::ostream &out, const DGNode &x)
 {
   Write(out, x.label);
   WriteBin(out, x.count);
@@ -32,7 +32,7 @@ void Write<DGNode>(std::ostream &out, const DGNode &x)
 }
 
 template <>
-void Read<DGNode>(std::istream &in, DGNode &x)
+inline void Read<DGNode>(std::istream &in, DGNode &x)
 {
 	Read(in, x.label);
 	ReadBin(in, x.count);
@@ -0,0 +1,74 @@
+#include "System.h"
+#include "Utility.h"
+#include "FontStyles.h"
+
+
+FontStyleRegistry::FontStyleRegistry()
+  : options(cairo_font_options_create())
+{
+  cairo_matrix_init_identity(&ctm);
+}
+
+FontStyleRegistry::~FontStyleRegistry()
+{
+  Clear();
+  cairo_font_options_destroy(options);
+}
+
+// Hinting and so the metrics of a font depend on the surface type and the
+// device scale, so those identify the target
+void FontStyleRegistry::SetTarget(cairo_t *cairo, cairo_surface_t *output)
+{
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cairo, &matrix);
+  cairo_surface_t *surface = output ? output : cairo_get_target(cairo);
+  ostringstream new_target;
+  new_target << setprecision(17) << int(cairo_surface_get_type(surface))
+             << " " << matrix.xx << " " << matrix.yy;
+  if (new_target.str() == target)
+    return;
+
+  Clear();
+  target = new_target.str();
+  // translation does not change how glyphs are hinted
+  ctm = matrix;
+  ctm.x0 = ctm.y0 = 0.0;
+  cairo_surface_get_font_options(surface, options);
+}
+
+int FontStyleRegistry::Find(const string &face, cairo_font_slant_t slant,
+                            cairo_font_weight_t weight, double size)
+{
+  string key = face;
+  key += '\0';
+  key.append((const char *)&size, sizeof(size));
+  key += char('0' + slant);
+  key += char('0' + weight);
+
+  unordered_map<string, int>::const_iterator iter = ids.find(key);
+  if (iter != ids.end())
+    return iter->second;
+
+  cairo_font_face_t *font_face =
+    cairo_toy_font_face_create(face.c_str(), slant, weight);
+  cairo_matrix_t font_matrix;
+  cairo_matrix_init_scale(&font_matrix, size, size);
+  cairo_scaled_font_t *font =
+    cairo_scaled_font_create(font_face, &font_matrix, &ctm, options);
+  cairo_font_face_destroy(font_face);
+  Assert(cairo_scaled_font_status(font) == CAIRO_STATUS_SUCCESS);
+
+  int id = fonts.size();
+  fonts.push_back(font);
+  ids[key] = id;
+  return id;
+}
+
+void FontStyleRegistry::Clear()
+{
+  for (int i = 0; i < fonts.size(); ++i)
+    cairo_scaled_font_destroy(fonts[i]);
+  fonts.clear();
+  ids.clear();
+  target.clear();
+}
@@ -0,0 +1,49 @@
+// FontStyles.h: One cairo scaled font per text style, looked up by id, so
+// text is measured and drawn without resolving font names each time
+
+#ifndef FONTSTYLES_H
+#define FONTSTYLES_H
+
+#include "System.h"
+#ifdef CAIRO
+#include <cairo.h>
+#else
+#error Must compile with cairo!
+#endif
+
+// Fonts are created for one target (surface type and device transform) and
+// kept while the target stays the same, so repeated renders to the same
+// kind of output in one process reuse them.
+class FontStyleRegistry
+{
+public:
+  FontStyleRegistry();
+  ~FontStyleRegistry();
+
+  // Drops all fonts if the surface type or transform of cairo differs from
+  // the one they were created for.  output is the surface the text ends up
+  // on, if cairo draws into a recording of it.
+  void SetTarget(cairo_t *cairo, cairo_surface_t *output = NULL);
+  const string &Target() const { return target; }
+
+  // Id of the style, creating its font the first time it is asked for
+  int Find(const string &face, cairo_font_slant_t slant,
+           cairo_font_weight_t weight, double size);
+
+  cairo_scaled_font_t *Font(int id) const { return fonts[id]; }
+  int NumFonts() const { return fonts.size(); }
+
+  void Clear();
+
+private:
+  string target;
+  cairo_matrix_t ctm;
+  cairo_font_options_t *options;
+  unordered_map<string, int> ids;
+  vector<cairo_scaled_font_t *> fonts;
+
+  FontStyleRegistry(const FontStyleRegistry &);
+  FontStyleRegistry &operator=(const FontStyleRegistry &);
+};
+
+#endif
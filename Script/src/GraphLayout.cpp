@@ -0,0 +1,1218 @@
+#include "System.h"
+#include "Utility.h"
+#include "GraphLayout.h"
+
+
+double sqr(double x)
+{
+  return x * x;
+}
+
+double negsqr(double x)
+{
+  if (x < 0.0)
+    return x * x;
+  else
+    return 0.0;
+}
+
+double dnegsqr(double x)
+{
+  if (x < 0.0)
+    return 2.0 * x;
+  else
+    return 0.0;
+}
+
+// exp(-a*x), continued linearly below x = -10 with the same slope that
+// gradientF clamps to, so nodes far outside the canvas stay finite
+double hbarrier(double a, double x)
+{
+  if (x >= -10.0)
+    return exp(-a*x);
+  else
+    return exp(-a*(-10.0)) * (1.0 - a*(x + 10.0));
+}
+
+GraphLayout::GraphLayout(int num_nodes_, double image_size_x)
+  : num_nodes(num_nodes_), w(num_nodes), t(num_nodes), b(num_nodes),
+    B(num_nodes), A(num_nodes), L(num_nodes), 
+    G1(num_nodes), G2(num_nodes), H1(num_nodes), H2(num_nodes),
+    rB(num_nodes), rL(num_nodes),
+    p(num_nodes, -1), l(num_nodes, -1), r(num_nodes, -1),
+    first_child(num_nodes + 1), num_children(num_nodes), children(num_nodes),
+    Bw(1.0), Lw(3.0), G1w(1.0), G2w(10.0), Hw(10.0),
+    workers(NULL), block_sum((num_nodes + block_size - 1) / block_size),
+    kernels(NULL), trace(NULL), has_deadline(false)
+{
+  min_space = double(graph_branch_sep);
+  min_x = -0.5 * double(image_size_x) + min_space;
+  max_x = 0.5 * double(image_size_x) - min_space;
+}
+
+void GraphLayout::Preprocess()
+{
+  // initialize w[], t[], p[], l[] beforehand
+
+  num_children.assign(num_nodes, 0);
+  for (int i = 0; i < num_nodes; ++i)
+  {
+    if (l[i] >= 0)
+      r[l[i]] = i;
+    if (r[i] >= 0)
+      l[r[i]] = i;
+    if (p[i] >= 0)
+      ++num_children[p[i]];
+  }
+
+  // children of each node are stored in increasing index order in one
+  // array; first_child[] has an extra entry so each range ends at the next
+  // node's first child
+  first_child[0] = 0;
+  for (int i = 0; i < num_nodes; ++i)
+    first_child[i + 1] = first_child[i] + num_children[i];
+  vector<int> next(first_child.begin(), first_child.end() - 1);
+  for (int i = 0; i < num_nodes; ++i)
+    if (p[i] >= 0)
+      children[next[p[i]]++] = i;
+
+  for (int i = 0; i < num_nodes; ++i)
+  {
+    if (num_children[i] > 0)
+    {
+      int j = children[first_child[i]];
+      while ((l[j] >= 0) && (p[l[j]] == i))
+        j = l[j];
+      
+      double cur_b = -0.5*w[i];
+      while ((j >= 0) && (p[j] == i))
+      {
+        b[j] = cur_b + 0.5*w[j];
+        cur_b += w[j];
+        j = r[j];
+      }
+    }
+  }
+
+  if (kernels)
+  {
+    for (int i = 0; i < num_nodes; ++i)
+    {
+      if ((l[i] >= 0) && (l[i] != i - 1))
+      {
+        cerr << "Layout siblings are not numbered consecutively; "
+             << "using scalar kernels" << endl;
+        kernels = NULL;
+        break;
+      }
+    }
+  }
+
+  if (kernels)
+  {
+    kernel_data.Allocate(num_nodes);
+    kernel_data.Bw = Bw;
+    kernel_data.G1w = G1w;
+    kernel_data.G2w = G2w;
+    kernel_data.Hw = Hw;
+    for (int i = 0; i < num_nodes; ++i)
+    {
+      kernel_data.wB[i] = (p[i] >= 0) ? w[i] : 0.0;
+      kernel_data.b[i] = b[i];
+      kernel_data.pidx[i] = max(p[i], 0);
+      kernel_data.gr[i] = (r[i] >= 0) ? 1.0 : 0.0;
+      if (l[i] >= 0)
+      {
+        kernel_data.gl[i] = 1.0;
+        kernel_data.g1off[i] = 0.5*(w[i] + w[l[i]]) + min_space;
+        kernel_data.g2off[i] = 0.5*max(w[i] + w[l[i]], t[i] + t[l[i]]) + min_space;
+      }
+      double tw = max(w[i], t[i]);
+      kernel_data.hmin[i] = min_x + 0.5*tw;
+      kernel_data.hmax[i] = max_x - 0.5*tw;
+    }
+    dGH.resize(num_nodes);
+  }
+}
+
+void GraphLayout::computeB(const vector<double> &x, int begin, int end)
+{
+  for (int i = begin; i < end; ++i)
+  {
+    if (p[i] >= 0)
+      B[i] = w[i] * sqr(x[i] - (x[p[i]] + b[i]));
+    else
+      B[i] = 0.0;
+  }
+}
+
+void GraphLayout::computeA(const vector<double> &x, int begin, int end)
+{
+  for (int i = begin; i < end; ++i)
+  {
+    if (num_children[i] > 0)
+    {
+      A[i] = 0.0;
+      for (int c = first_child[i]; c < first_child[i + 1]; ++c)
+      {
+        int j = children[c];
+        A[i] += w[j] * (x[j] - b[j]);
+      }
+      A[i] = A[i] / w[i];
+    }
+  }
+}
+
+void GraphLayout::computeL(const vector<double> &x, int begin, int end)
+{
+  for (int i = begin; i < end; ++i)
+  {
+    if ((p[i] >= 0) && (num_children[i] > 0))
+      L[i] = w[i] * sqr(x[i] - 0.5 * (x[p[i]] + A[i]));
+    else
+      L[i] = 0.0;
+  }
+}
+
+void GraphLayout::computeG(const vector<double> &x, int begin, int end)
+{
+  for (int i = begin; i < end; ++i)
+  {
+    if (l[i] >= 0)
+    {
+      G1[i] = x[i] - x[l[i]] - 0.5*(w[i] + w[l[i]]) - min_space;
+      G2[i] = x[i] - x[l[i]] - 0.5*max(w[i] + w[l[i]], t[i] + t[l[i]]) - min_space;
+    }
+    else
+    {
+      G1[i] = 0.0;
+      G2[i] = 0.0;
+    }
+  }
+}
+
+void GraphLayout::computeH(const vector<double> &x, int begin, int end)
+{
+  for (int i = begin; i < end; ++i)
+  {
+    double tw = max(w[i], t[i]);
+    double mi = min_x + 0.5 * tw;
+    double ma = max_x - 0.5 * tw;
+    H1[i] = x[i] - mi;
+    H2[i] = ma - x[i];
+  }
+}
+
+double GraphLayout::computeF(const vector<double> &x)
+{
+  // a node's terms only read its own A[], so every array can be filled in
+  // block by block in a single pass
+  ForBlocks([&](int block, int begin, int end)
+  {
+    if (kernels)
+    {
+      computeA(x, begin, end);
+      computeL(x, begin, end);
+      double total = kernels->objective(kernel_data, &x[0], begin, end, &B[0],
+                                        &G1[0], &G2[0], &H1[0], &H2[0]);
+      for (int i = begin; i < end; ++i)
+        total += Lw*L[i];
+      block_sum[block] = total;
+      return;
+    }
+
+    computeB(x, begin, end);
+    computeA(x, begin, end);
+    computeL(x, begin, end);
+    computeG(x, begin, end);
+    computeH(x, begin, end);
+
+    double total = 0.0;
+    for (int i = begin; i < end; ++i)
+    {
+#if 0
+      total += Bw*B[i] + Lw*L[i] + 
+        exp(-G1w*G1[i]) + exp(-G2w*G2[i]) + exp(-Hw*H1[i]) + exp(-Hw*H2[i]);
+#else
+      total += Bw*B[i] + Lw*L[i] +
+        exp(-G1w*G1[i]) + negsqr(G2w*G2[i]) + hbarrier(Hw, H1[i]) + hbarrier(Hw, H2[i]);
+#endif
+    }
+    block_sum[block] = total;
+  });
+
+  return SumBlocks();
+}
+
+LayoutTerms GraphLayout::computeTerms(const vector<double> &x)
+{
+  computeB(x);
+  computeA(x);
+  computeL(x);
+  computeG(x);
+  computeH(x);
+
+  LayoutTerms terms;
+  for (int i = 0; i < num_nodes; ++i)
+  {
+    terms.B += Bw*B[i];
+    terms.L += Lw*L[i];
+    terms.G += exp(-G1w*G1[i]) + negsqr(G2w*G2[i]);
+    terms.H += hbarrier(Hw, H1[i]) + hbarrier(Hw, H2[i]);
+  }
+  return terms;
+}
+
+void GraphLayout::gradientF(const vector<double> &x, vector<double> &dx)
+{
+  dx.resize(x.size());
+
+  // B and L terms only involve a node, its parent and its children.  The
+  // first pass computes each term's residual, the second gathers the terms
+  // touching each node in index order, so blocks never write to each
+  // other's nodes
+  ForBlocks([&](int block, int begin, int end)
+  {
+    computeA(x, begin, end);
+    if (kernels)
+    {
+      kernels->residuals(kernel_data, &x[0], begin, end, &rB[0],
+                         &G1[0], &G2[0], &H1[0], &H2[0]);
+      for (int i = begin; i < end; ++i)
+        if ((p[i] >= 0) && (num_children[i] > 0))
+          rL[i] = x[i] - 0.5*(x[p[i]] + A[i]);
+      return;
+    }
+
+    computeG(x, begin, end);
+    computeH(x, begin, end);
+
+    for (int i = begin; i < end; ++i)
+    {
+      if (p[i] >= 0)
+      {
+        rB[i] = x[i] - (x[p[i]] + b[i]);
+        if (num_children[i] > 0)
+          rL[i] = x[i] - 0.5*(x[p[i]] + A[i]);
+      }
+    }
+  });
+
+  ForBlocks([&](int block, int begin, int end)
+  {
+    if (kernels)
+      kernels->gradient(kernel_data, &G1[0], &G2[0], &H1[0], &H2[0],
+                        begin, end, &dGH[0]);
+
+    for (int k = begin; k < end; ++k)
+    {
+      double dB = 0.0;
+      double dL = 0.0;
+      if (p[k] >= 0)
+      {
+        if (p[p[k]] >= 0)
+          dL -= w[k] * rL[p[k]];
+        dB += 2.0 * w[k] * rB[k];
+        if (num_children[k] > 0)
+          dL += 2.0 * w[k] * rL[k];
+      }
+      for (int c = first_child[k]; c < first_child[k + 1]; ++c)
+      {
+        int j = children[c];
+        dB -= 2.0 * w[j] * rB[j];
+        if (num_children[j] > 0)
+          dL -= w[j] * rL[j];
+      }
+
+      if (kernels)
+      {
+        dx[k] = Bw*dB + Lw*dL + dGH[k];
+        continue;
+      }
+
+      // a node with no left neighbour has G1 = 0, a constant term
+      double dG = 0.0;
+      if (l[k] >= 0)
+        dG -= exp(-G1w*G1[k]) * G1w;
+#if 0
+      dG -= exp(-G2w*G2[k]) * G2w;
+#else
+      dG += dnegsqr(G2w*G2[k]) * G2w;
+#endif
+      if (r[k] >= 0)
+      {
+        dG += exp(-G1w*G1[r[k]]) * G1w;
+#if 0
+        dG += exp(-G2w*G2[r[k]]) * G2w;
+#else
+        dG -= dnegsqr(G2w*G2[r[k]]) * G2w;
+#endif
+      }
+
+      double dH = 0.0;
+      if (H1[k] >= -10.0)
+        dH -= exp(-Hw*H1[k]) * Hw;
+      else
+        dH -= exp(-Hw*(-10.0)) * Hw;
+      if (H2[k] >= -10.0)
+        dH += exp(-Hw*H2[k]) * Hw;
+      else
+        dH += exp(-Hw*(-10.0)) * Hw;
+
+      dx[k] = Bw*dB + Lw*dL + dG + dH;
+    }
+  });
+}
+
+double GraphLayout::GradientError(const vector<double> &x, int &worst)
+{
+  vector<double> g, xh = x;
+  gradientF(x, g);
+  // differences are measured against the largest component, since F is
+  // large enough that rounding leaves central differences of nearly flat
+  // components with an absolute error of around 1e-2
+  double scale = 1.0;
+  for (int i = 0; i < num_nodes; ++i)
+    scale = max(scale, fabs(g[i]));
+  double error = 0.0;
+  worst = -1;
+  for (int i = 0; i < num_nodes; ++i)
+  {
+    double h = 1e-6 * max(1.0, fabs(x[i]));
+    xh[i] = x[i] + h;
+    double f_plus = computeF(xh);
+    xh[i] = x[i] - h;
+    double f_minus = computeF(xh);
+    xh[i] = x[i];
+    double fd = (f_plus - f_minus) / (2.0 * h);
+    double e = fabs(fd - g[i]) / scale;
+    if (e > error)
+    {
+      error = e;
+      worst = i;
+    }
+  }
+  computeF(x);
+  return error;
+}
+
+double GraphLayout::FollowGradient(vector<double> &x, double step)
+{
+  vector<double> gx(x.size());
+  gradientF(x, gx);
+#if 0
+  cerr << "gradient: ";
+  for (int i = 0; i < gx.size(); ++i)
+    cerr << gx[i] << " ";
+  cerr << endl;
+#endif
+
+  ForBlocks([&](int block, int begin, int end)
+  {
+    double mag = 0.0;
+    for (int i = begin; i < end; ++i)
+      mag += sqr(gx[i]);
+    block_sum[block] = mag;
+  });
+  double mag = sqrt(SumBlocks());
+  Assert(mag > 0.0);
+
+  double scale = step / mag;
+
+  //cerr << StrFitLeft("x", 16, ' ') << StrFitLeft("gx", 16, ' ') << StrFitLeft("dx", 16, ' ') << endl;
+  ForBlocks([&](int block, int begin, int end)
+  {
+    for (int i = begin; i < end; ++i)
+    {
+      x[i] += gx[i] * scale;
+      //cerr << StrFitLeft(x[i], 16, ' ') << StrFitLeft(gx[i], 16, ' ') << StrFitLeft(gx[i] * scale, 16, ' ') << endl;
+    }
+  });
+
+  return mag;
+}
+
+double GraphLayout::SumBlocks() const
+{
+  double total = 0.0;
+  for (int block = 0; block < block_sum.size(); ++block)
+    total += block_sum[block];
+  return total;
+}
+
+void GraphLayout::Trace(int iteration, const vector<double> &x,
+                        double gradient_norm, double step, bool force)
+{
+  if (!trace || !(force || trace->Due(iteration)))
+    return;
+  if (!trace->records.empty() && (trace->records.back().stage == trace->stage) &&
+      (trace->records.back().iteration == iteration))
+    return;
+
+  if (gradient_norm < 0.0)
+  {
+    vector<double> g;
+    gradientF(x, g);
+    g[0] = 0.0;
+    gradient_norm = 0.0;
+    for (int i = 0; i < g.size(); ++i)
+      gradient_norm += g[i] * g[i];
+    gradient_norm = sqrt(gradient_norm);
+  }
+
+  LayoutTraceRecord record;
+  record.stage = trace->stage;
+  record.iteration = iteration;
+  record.seconds = trace->Seconds();
+  record.terms = computeTerms(x);
+  record.gradient_norm = gradient_norm;
+  record.step = step;
+  trace->records.push_back(record);
+}
+
+LayoutResult GraphLayout::Descend(vector<double> &x, int total_iterations)
+{
+  LayoutResult result;
+  Trace(0, x, -1.0, 0.0, true);
+
+  // the objective does not fall steadily under a fixed schedule, so with a
+  // deadline the best layout is kept, checked every 100 steps
+  vector<double> best_x;
+  double best_f = HUGE_VAL;
+  if (has_deadline)
+  {
+    best_x = x;
+    best_f = computeF(x);
+  }
+
+  for (result.iterations = 0; result.iterations < total_iterations;
+       ++result.iterations)
+  {
+    int iteration = result.iterations;
+    if (DeadlinePassed())
+    {
+      result.cut_off = true;
+      break;
+    }
+
+    double step = double(total_iterations - iteration) / double(total_iterations);
+    result.gradient_norm = FollowGradient(x, -step);
+    x[0] = 0.0;
+    Trace(iteration + 1, x, result.gradient_norm, step,
+          (iteration + 1) == total_iterations);
+    if ((iteration % 2000) == 0)
+      cerr << "." << flush;
+#if 0
+    cerr << "x: ";
+    for (int i = 0; i < x.size(); ++i)
+      cerr << x[i] << " ";
+    cerr << endl;
+#endif
+
+    if (has_deadline && (((iteration + 1) % 100) == 0))
+    {
+      double f = computeF(x);
+      if (f < best_f)
+      {
+        best_f = f;
+        best_x = x;
+      }
+    }
+  }
+
+  result.objective = computeF(x);
+  if (result.cut_off && (best_f < result.objective))
+  {
+    x = best_x;
+    result.objective = best_f;
+  }
+  return result;
+}
+
+
+double dot(const vector<double> &a, const vector<double> &b)
+{
+  double sum = 0.0;
+  for (int i = 0; i < a.size(); ++i)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+double GraphLayout::EvaluateStep(const vector<double> &x,
+                                 const vector<double> &d, double step,
+                                 vector<double> &x_new,
+                                 vector<double> &g_new, double &dg_new)
+{
+  for (int i = 0; i < num_nodes; ++i)
+    x_new[i] = x[i] + step * d[i];
+
+  double f_new = computeF(x_new);
+  if (!isfinite(f_new))
+    return numeric_limits<double>::infinity();
+
+  gradientF(x_new, g_new);
+  g_new[0] = 0.0;
+  dg_new = dot(g_new, d);
+  return f_new;
+}
+
+double GraphLayout::LineSearch(const vector<double> &x, double f, double dg,
+                               const vector<double> &d, double step,
+                               vector<double> &x_new, double &f_new,
+                               vector<double> &g_new)
+{
+  // Nocedal & Wright, algorithms 3.5 and 3.6.  The barrier terms overflow
+  // for steps that push nodes far through each other, so a non-finite
+  // objective is treated like a failed sufficient decrease test.
+  const double c1 = 1e-4, c2 = 0.9;
+  const int max_bracket = 20, max_zoom = 30;
+
+  double lo = 0.0, f_lo = f, dg_lo = dg;
+  double hi = 0.0, f_hi = f;
+  bool bracketed = false;
+
+  double a = step;
+  for (int i = 0; i < max_bracket; ++i)
+  {
+    double dg_a = 0.0;
+    double f_a = EvaluateStep(x, d, a, x_new, g_new, dg_a);
+    if ((f_a > f + c1 * a * dg) || ((i > 0) && (f_a >= f_lo)))
+    {
+      hi = a;
+      f_hi = f_a;
+      bracketed = true;
+      break;
+    }
+    if (fabs(dg_a) <= -c2 * dg)
+    {
+      f_new = f_a;
+      return a;
+    }
+    if (dg_a >= 0.0)
+    {
+      hi = lo;
+      f_hi = f_lo;
+      lo = a;
+      f_lo = f_a;
+      dg_lo = dg_a;
+      bracketed = true;
+      break;
+    }
+    lo = a;
+    f_lo = f_a;
+    dg_lo = dg_a;
+    a *= 2.0;
+  }
+
+  if (bracketed)
+  {
+    for (int i = 0; i < max_zoom; ++i)
+    {
+      // Quadratic interpolation from f_lo, dg_lo and f_hi, safeguarded to
+      // stay inside the bracket, falling back to bisection
+      double width = hi - lo;
+      a = lo + 0.5 * width;
+      if (isfinite(f_hi))
+      {
+        double denom = 2.0 * (f_hi - f_lo - dg_lo * width);
+        if (denom > 0.0)
+        {
+          double q = lo - dg_lo * width * width / denom;
+          double a_min = min(lo, hi) + 0.1 * fabs(width);
+          double a_max = max(lo, hi) - 0.1 * fabs(width);
+          if ((q >= a_min) && (q <= a_max))
+            a = q;
+        }
+      }
+
+      double dg_a = 0.0;
+      double f_a = EvaluateStep(x, d, a, x_new, g_new, dg_a);
+      if ((f_a > f + c1 * a * dg) || (f_a >= f_lo))
+      {
+        hi = a;
+        f_hi = f_a;
+      }
+      else
+      {
+        if (fabs(dg_a) <= -c2 * dg)
+        {
+          f_new = f_a;
+          return a;
+        }
+        if (dg_a * (hi - lo) >= 0.0)
+        {
+          hi = lo;
+          f_hi = f_lo;
+        }
+        lo = a;
+        f_lo = f_a;
+        dg_lo = dg_a;
+      }
+    }
+  }
+
+  // No step satisfied the curvature condition; settle for the best
+  // decrease found, if any
+  if ((lo > 0.0) && (f_lo < f))
+  {
+    double dg_lo_new;
+    f_new = EvaluateStep(x, d, lo, x_new, g_new, dg_lo_new);
+    return lo;
+  }
+  return 0.0;
+}
+
+LayoutResult GraphLayout::MinimizeLBFGS(vector<double> &x, int max_iterations,
+                                        double f_tolerance,
+                                        double g_tolerance, int history)
+{
+  LayoutResult result;
+
+  vector<double> g(num_nodes), d(num_nodes);
+  vector<double> x_new(num_nodes), g_new(num_nodes);
+  vector< vector<double> > s(history, vector<double>(num_nodes));
+  vector< vector<double> > y(history, vector<double>(num_nodes));
+  vector<double> rho(history), alpha(history);
+  int stored = 0, newest = -1;
+
+  // node 0 is the root and stays pinned at 0
+  x[0] = 0.0;
+  double f = computeF(x);
+  gradientF(x, g);
+  g[0] = 0.0;
+  Trace(0, x, sqrt(dot(g, g)), 0.0, true);
+
+  for (result.iterations = 0; result.iterations < max_iterations;
+       ++result.iterations)
+  {
+    double gnorm = sqrt(dot(g, g));
+    if (gnorm <= g_tolerance * max(1.0, sqrt(dot(x, x))))
+    {
+      result.converged = true;
+      break;
+    }
+    // every accepted step lowers the objective, so x is the best so far
+    if (DeadlinePassed())
+    {
+      result.cut_off = true;
+      break;
+    }
+
+    // two-loop recursion for d = -H g
+    for (int i = 0; i < num_nodes; ++i)
+      d[i] = -g[i];
+    for (int k = 0; k < stored; ++k)
+    {
+      int j = (newest - k + history) % history;
+      alpha[j] = rho[j] * dot(s[j], d);
+      for (int i = 0; i < num_nodes; ++i)
+        d[i] -= alpha[j] * y[j][i];
+    }
+    double gamma = (stored > 0) ?
+      (dot(s[newest], y[newest]) / dot(y[newest], y[newest])) : (1.0 / gnorm);
+    for (int i = 0; i < num_nodes; ++i)
+      d[i] *= gamma;
+    for (int k = stored - 1; k >= 0; --k)
+    {
+      int j = (newest - k + history) % history;
+      double beta = rho[j] * dot(y[j], d);
+      for (int i = 0; i < num_nodes; ++i)
+        d[i] += (alpha[j] - beta) * s[j][i];
+    }
+    d[0] = 0.0;
+
+    double dg = dot(d, g);
+    if (dg >= 0.0)
+    {
+      // not a descent direction; drop the curvature history
+      for (int i = 0; i < num_nodes; ++i)
+        d[i] = -g[i] / gnorm;
+      dg = -gnorm;
+      stored = 0;
+    }
+
+    double f_new;
+    double step = LineSearch(x, f, dg, d, 1.0, x_new, f_new, g_new);
+    if (step <= 0.0)
+    {
+      if (stored == 0)
+        break;
+      stored = 0;
+      continue;
+    }
+
+    newest = (newest + 1) % history;
+    for (int i = 0; i < num_nodes; ++i)
+    {
+      s[newest][i] = x_new[i] - x[i];
+      y[newest][i] = g_new[i] - g[i];
+    }
+    double sy = dot(s[newest], y[newest]);
+    if (sy > 1e-10 * dot(y[newest], y[newest]))
+    {
+      rho[newest] = 1.0 / sy;
+      stored = min(stored + 1, history);
+    }
+    else
+    {
+      // the rejected pair overwrote the oldest one when the history was full
+      newest = (newest - 1 + history) % history;
+      stored = min(stored, history - 1);
+    }
+
+    bool small_change =
+      (fabs(f - f_new) <= f_tolerance * max(max(fabs(f), fabs(f_new)), 1.0));
+
+    x.swap(x_new);
+    g.swap(g_new);
+    f = f_new;
+    if (trace)
+      Trace(result.iterations + 1, x, sqrt(dot(g, g)), step * sqrt(dot(d, d)),
+            small_change);
+
+    if (small_change)
+    {
+      ++result.iterations;
+      result.converged = true;
+      break;
+    }
+  }
+
+  result.objective = f;
+  result.gradient_norm = sqrt(dot(g, g));
+  Trace(result.iterations, x, result.gradient_norm, 0.0, true);
+  return result;
+}
+
+LayoutResult GraphLayout::MinimizeMultilevel(vector<double> &x,
+                                             int max_iterations,
+                                             double f_tolerance,
+                                             double g_tolerance)
+{
+  // nodes are numbered level by level, so the first few levels of the tree
+  // are a prefix of the nodes; level_end[d] is the end of level d
+  vector<int> depth(num_nodes, 0);
+  vector<int> level_end;
+  for (int i = 0; i < num_nodes; ++i)
+  {
+    if (p[i] >= 0)
+      depth[i] = depth[p[i]] + 1;
+    if ((i > 0) && (depth[i] < depth[i - 1]))
+    {
+      cerr << "Layout nodes are not numbered by level; "
+           << "solving without coarse levels" << endl;
+      return MinimizeLBFGS(x, max_iterations, f_tolerance, g_tolerance);
+    }
+    if (depth[i] == level_end.size())
+      level_end.push_back(i);
+    level_end[depth[i]] = i + 1;
+  }
+
+  LayoutResult result;
+  int solved = 1;
+  for (int d = 1; d < level_end.size(); ++d)
+  {
+    int n = level_end[d];
+    for (int i = solved; i < n; ++i)
+      x[i] = x[p[i]] + b[i];
+    solved = n;
+
+    LayoutResult stage;
+    if (trace)
+      trace->stage = d + 1;
+    if (n == num_nodes)
+      stage = MinimizeLBFGS(x, max_iterations, f_tolerance, g_tolerance);
+    else
+    {
+      GraphLayout coarse(n, 0.0);
+      copy(w.begin(), w.begin() + n, coarse.w.begin());
+      copy(t.begin(), t.begin() + n, coarse.t.begin());
+      copy(p.begin(), p.begin() + n, coarse.p.begin());
+      copy(l.begin(), l.begin() + n, coarse.l.begin());
+      coarse.Bw = Bw;
+      coarse.Lw = Lw;
+      coarse.G1w = G1w;
+      coarse.G2w = G2w;
+      coarse.Hw = Hw;
+      coarse.min_space = min_space;
+      coarse.min_x = min_x;
+      coarse.max_x = max_x;
+      coarse.workers = workers;
+      coarse.kernels = kernels;
+      coarse.trace = trace;
+      coarse.has_deadline = has_deadline;
+      coarse.deadline = deadline;
+      coarse.Preprocess();
+
+      vector<double> coarse_x(x.begin(), x.begin() + n);
+      stage = coarse.MinimizeLBFGS(coarse_x, max_iterations, f_tolerance,
+                                   g_tolerance);
+      copy(coarse_x.begin(), coarse_x.end(), x.begin());
+    }
+    cerr << "." << flush;
+
+    result.iterations += stage.iterations;
+    result.objective = stage.objective;
+    result.gradient_norm = stage.gradient_norm;
+    result.converged = stage.converged;
+
+    if (stage.cut_off || ((n < num_nodes) && DeadlinePassed()))
+    {
+      // out of time: the finer levels keep their places under their parents
+      for (int i = solved; i < num_nodes; ++i)
+        x[i] = x[p[i]] + b[i];
+      result.cut_off = true;
+      result.converged = false;
+      if (n < num_nodes)
+        result.objective = computeF(x);
+      break;
+    }
+  }
+
+  if (trace)
+    trace->stage = 0;
+  return result;
+}
+
+// Weighted least squares fit of a nondecreasing y to target, by pooling
+// adjacent violators
+void IsotonicRegression(const vector<double> &target,
+                        const vector<double> &weight, vector<double> &y)
+{
+  vector<double> pool_value, pool_weight;
+  vector<int> pool_size;
+  for (int i = 0; i < target.size(); ++i)
+  {
+    pool_value.push_back(target[i]);
+    pool_weight.push_back(weight[i]);
+    pool_size.push_back(1);
+    while ((pool_value.size() > 1) &&
+           (pool_value[pool_value.size() - 2] > pool_value.back()))
+    {
+      int k = pool_value.size() - 2;
+      double total_weight = pool_weight[k] + pool_weight[k + 1];
+      pool_value[k] = (pool_weight[k] * pool_value[k] +
+                       pool_weight[k + 1] * pool_value[k + 1]) / total_weight;
+      pool_weight[k] = total_weight;
+      pool_size[k] += pool_size[k + 1];
+      pool_value.pop_back();
+      pool_weight.pop_back();
+      pool_size.pop_back();
+    }
+  }
+
+  y.resize(target.size());
+  int i = 0;
+  for (int k = 0; k < pool_value.size(); ++k)
+    for (int j = 0; j < pool_size[k]; ++j)
+      y[i++] = pool_value[k];
+}
+
+// Moves the nodes of one level, left to right, towards their best
+// positions with every other level fixed.  Each B and L term touching a
+// node is quadratic in it, so apart from the parents' L terms, which are
+// approximated below, the level's share of the objective is a weighted
+// sum of squares sum_k weight[k] * (x - target[k])^2.  Substituting
+// y = x - offset, where offset adds up the minimum gaps, turns the
+// spacing constraints into y being nondecreasing.  Returns the largest
+// move.
+double GraphLayout::SolveLevel(const vector<int> &level,
+                               const vector<double> &child_w,
+                               vector<double> &x)
+{
+  int n = level.size();
+  vector<double> target(n), weight(n);
+
+  // A[] of this level and of its parents, from the current positions
+  for (int k = 0; k < n; ++k)
+  {
+    int i = level[k];
+    computeA(x, i, i + 1);
+    if ((k == 0) || (p[i] != p[level[k - 1]]))
+      computeA(x, p[i], p[i] + 1);
+  }
+
+  for (int k = 0; k < n; ++k)
+  {
+    int i = level[k];
+    int q = p[i];
+    double total_weight = 0.0, total = 0.0;
+
+    // B[i] and L[i]
+    total_weight += Bw*w[i];
+    total += Bw*w[i] * (x[q] + b[i]);
+    if (num_children[i] > 0)
+    {
+      total_weight += Lw*w[i];
+      total += Lw*w[i] * 0.5*(x[q] + A[i]);
+    }
+
+    // L[q] depends on all of this node's siblings through A[q], a rank
+    // one coupling that a separable fit cannot express.  Its share of the
+    // correction is spread over them by width, so that moving them all at
+    // once roughly fixes it rather than overshooting; this is why a sweep
+    // is not an exact minimization.
+    if (p[q] >= 0)
+    {
+      double share = child_w[q] / w[q];
+      double r0 = x[q] - 0.5*(x[p[q]] + A[q]);
+      total_weight += Lw*0.25*share*w[i];
+      total += Lw*0.25*share*w[i] * (x[i] + 2.0*r0/share);
+    }
+
+    // B and L terms of the children
+    if (num_children[i] > 0)
+    {
+      total_weight += Bw*child_w[i];
+      total += Bw*A[i]*w[i];
+      for (int c = first_child[i]; c < first_child[i + 1]; ++c)
+      {
+        int j = children[c];
+        if (num_children[j] > 0)
+        {
+          computeA(x, j, j + 1);
+          total_weight += Lw*0.25*w[j];
+          total += Lw*0.25*w[j] * (2.0*x[j] - A[j]);
+        }
+      }
+    }
+
+    weight[k] = total_weight;
+    target[k] = total / total_weight;
+  }
+
+  // Neighbours are kept apart by their label spacing if the level fits on
+  // the canvas with it, else by their bar spacing, else by the largest
+  // fraction of the bar spacing that fits; overlapping bars cost far less
+  // than leaving the canvas
+  vector<double> offset(n), lower(n), upper(n);
+  auto fit = [&](bool labels, double share)
+  {
+    for (int k = 0; k < n; ++k)
+    {
+      int i = level[k];
+      if (k > 0)
+      {
+        int j = level[k - 1];
+        double gap = labels ?
+          0.5*max(w[i] + w[j], t[i] + t[j]) : 0.5*(w[i] + w[j]);
+        offset[k] = offset[k - 1] + share*(gap + min_space);
+      }
+      double tw = max(w[i], t[i]);
+      lower[k] = min_x + 0.5*tw - offset[k];
+      upper[k] = max_x - 0.5*tw - offset[k];
+    }
+
+    // y is nondecreasing, so each bound also applies to the nodes on the
+    // far side of it; once both bounds are monotone the constrained
+    // solution is the unconstrained one clamped to them
+    for (int k = 1; k < n; ++k)
+      lower[k] = max(lower[k], lower[k - 1]);
+    for (int k = n - 2; k >= 0; --k)
+      upper[k] = min(upper[k], upper[k + 1]);
+    for (int k = 0; k < n; ++k)
+      if (lower[k] > upper[k])
+        return false;
+    return true;
+  };
+
+  if (!fit(true, 1.0) && !fit(false, 1.0))
+  {
+    double fits = 0.0, too_much = 1.0;
+    for (int step = 0; step < 30; ++step)
+    {
+      double share = 0.5*(fits + too_much);
+      if (fit(false, share))
+        fits = share;
+      else
+        too_much = share;
+    }
+    if (!fit(false, fits))
+    {
+      // a node taller than the canvas; leave the level unbounded
+      for (int k = 0; k < n; ++k)
+      {
+        lower[k] = -HUGE_VAL;
+        upper[k] = HUGE_VAL;
+      }
+    }
+  }
+
+  for (int k = 0; k < n; ++k)
+    target[k] -= offset[k];
+  vector<double> y;
+  IsotonicRegression(target, weight, y);
+
+  double moved = 0.0;
+  for (int k = 0; k < n; ++k)
+  {
+    int i = level[k];
+    double new_x = min(max(y[k], lower[k]), upper[k]) + offset[k];
+    moved = max(moved, fabs(new_x - x[i]));
+    x[i] = new_x;
+  }
+  return moved;
+}
+
+LayoutResult GraphLayout::SolveDirect(vector<double> &x, int max_sweeps,
+                                      double tolerance)
+{
+  // each level is a chain of nodes linked by l[] and r[]; chains are
+  // ordered by the depth of their nodes
+  vector<int> depth(num_nodes, 0);
+  vector< pair<int, int> > heads;
+  for (int i = 0; i < num_nodes; ++i)
+  {
+    if (p[i] >= 0)
+      depth[i] = depth[p[i]] + 1;
+    if ((l[i] < 0) && (p[i] >= 0))
+      heads.push_back(make_pair(depth[i], i));
+  }
+  stable_sort(heads.begin(), heads.end());
+  vector< vector<int> > levels(heads.size());
+  for (int h = 0; h < heads.size(); ++h)
+    for (int i = heads[h].second; i >= 0; i = r[i])
+      levels[h].push_back(i);
+
+  vector<double> child_w(num_nodes, 0.0);
+  for (int i = 0; i < num_nodes; ++i)
+    if (p[i] >= 0)
+      child_w[p[i]] += w[i];
+
+  LayoutResult result;
+  x[0] = 0.0;
+  Trace(0, x, -1.0, 0.0, true);
+
+  // sweeps approximate the L coupling and ignore the barriers, so the
+  // objective need not fall with each one; with a deadline the best layout
+  // is kept
+  vector<double> best_x;
+  double best_f = HUGE_VAL;
+  if (has_deadline)
+  {
+    best_x = x;
+    best_f = computeF(x);
+  }
+
+  for (result.iterations = 0; result.iterations < max_sweeps;)
+  {
+    if (DeadlinePassed())
+    {
+      result.cut_off = true;
+      break;
+    }
+
+    double moved = 0.0;
+    for (int h = 0; h < levels.size(); ++h)
+      moved = max(moved, SolveLevel(levels[h], child_w, x));
+    for (int h = int(levels.size()) - 2; h >= 0; --h)
+      moved = max(moved, SolveLevel(levels[h], child_w, x));
+    ++result.iterations;
+    if ((result.iterations % 10) == 0)
+      cerr << "." << flush;
+    result.converged = (moved <= tolerance);
+    Trace(result.iterations, x, -1.0, moved,
+          result.converged || (result.iterations == max_sweeps));
+    if (result.converged)
+      break;
+
+    if (has_deadline)
+    {
+      double f = computeF(x);
+      if (f < best_f)
+      {
+        best_f = f;
+        best_x = x;
+      }
+    }
+  }
+  if (result.cut_off && (best_f < computeF(x)))
+    x = best_x;
+
+  vector<double> g;
+  gradientF(x, g);
+  g[0] = 0.0;
+  result.objective = computeF(x);
+  result.gradient_norm = sqrt(dot(g, g));
+  return result;
+}
+
+
+LayoutOptimizer ParseLayoutOptimizer(const string &name)
+{
+  string lower = GetLower(name);
+  if (lower == "descent")
+    return LayoutDescent;
+  else if (lower == "lbfgs")
+    return LayoutLBFGS;
+  else if (lower == "multilevel")
+    return LayoutMultilevel;
+  else if (lower == "direct")
+    return LayoutDirect;
+
+  cerr << "Unknown layout optimizer: " << name << endl;
+  Exit(1);
+  return LayoutDescent;
+}
+
+string LayoutOptimizerName(LayoutOptimizer optimizer)
+{
+  switch (optimizer)
+  {
+  case LayoutDescent:
+    return "descent";
+  case LayoutLBFGS:
+    return "lbfgs";
+  case LayoutMultilevel:
+    return "multilevel";
+  case LayoutDirect:
+    return "direct";
+  }
+  Assert(false);
+  return "";
+}
+
+LayoutSimd ParseLayoutSimd(const string &name)
+{
+  string lower = GetLower(name);
+  if (lower == "off")
+    return LayoutSimdOff;
+  else if (lower == "auto")
+    return LayoutSimdAuto;
+  else if (lower == "sse2")
+    return LayoutSimdSSE2;
+  else if (lower == "avx2")
+    return LayoutSimdAVX2;
+
+  cerr << "Unknown layout_simd: " << name << endl;
+  Exit(1);
+  return LayoutSimdOff;
+}
+
+const LayoutKernels *SelectLayoutKernels(LayoutSimd simd)
+{
+  bool avx2 = (layout_kernels_avx2.objective != NULL) &&
+    LayoutKernelsAVX2Supported();
+  bool sse2 = LayoutKernelsSSE2Supported();
+
+  switch (simd)
+  {
+  case LayoutSimdOff:
+    return NULL;
+  case LayoutSimdAuto:
+    if (avx2)
+      return &layout_kernels_avx2;
+    return sse2 ? &layout_kernels_sse2 : NULL;
+  case LayoutSimdAVX2:
+    if (avx2)
+      return &layout_kernels_avx2;
+    cerr << "AVX2 layout kernels not available; using SSE2" << endl;
+    return sse2 ? &layout_kernels_sse2 : NULL;
+  case LayoutSimdSSE2:
+    if (sse2)
+      return &layout_kernels_sse2;
+    cerr << "SSE2 layout kernels not available in this build" << endl;
+    return NULL;
+  }
+  return NULL;
+}
@@ -0,0 +1,185 @@
+// GraphLayout.h: Positions the nodes of each phylogeny level by minimizing
+// a penalty objective over their vertical offsets
+
+#ifndef GRAPHLAYOUT_H
+#define GRAPHLAYOUT_H
+
+#include "System.h"
+#include "GraphLayoutKernels.h"
+#include "GraphLayoutTrace.h"
+
+enum LayoutOptimizer
+{
+  LayoutDescent,
+  LayoutLBFGS,
+  LayoutMultilevel,
+  LayoutDirect
+};
+
+LayoutOptimizer ParseLayoutOptimizer(const string &name);
+string LayoutOptimizerName(LayoutOptimizer optimizer);
+
+enum LayoutSimd
+{
+  LayoutSimdOff,
+  LayoutSimdAuto,
+  LayoutSimdSSE2,
+  LayoutSimdAVX2
+};
+
+LayoutSimd ParseLayoutSimd(const string &name);
+// Returns the kernels for the requested instruction set, or NULL for the
+// scalar code; auto picks AVX2 when the CPU has it, else SSE2
+const LayoutKernels *SelectLayoutKernels(LayoutSimd simd);
+
+struct LayoutResult
+{
+  int iterations;
+  double objective;
+  double gradient_norm;
+  bool converged;
+  bool cut_off;          // stopped by the deadline
+
+  LayoutResult()
+    : iterations(0), objective(0.0), gradient_norm(0.0), converged(false),
+      cut_off(false) { }
+};
+
+struct GraphLayout
+{
+  int num_nodes;
+  vector<double> w, t, b, B, A, L, G1, G2, H1, H2;
+  vector<double> rB, rL;
+  vector<int> p, l, r;
+  // children of node i are children[first_child[i] .. first_child[i + 1])
+  vector<int> first_child, num_children, children;
+  double Bw, Lw, G1w, G2w, Hw;
+  double min_space, min_x, max_x;
+  static constexpr double graph_branch_sep = 10.0;
+
+  // Per-node passes are split into fixed blocks of nodes that may run on
+  // separate threads; sums are reduced in block order, so the result does
+  // not depend on the number of threads.  workers is not owned and may be
+  // left NULL to run single-threaded.
+  static const int block_size = 1024;
+  WorkerGroup *workers;
+  vector<double> block_sum;
+
+  // Vectorized B/G/H kernels, or NULL for the scalar code.  Set before
+  // Preprocess(), which fills in kernel_data.  The kernels use a
+  // polynomial exp(), so results differ from the scalar code in the last
+  // few bits.
+  const LayoutKernels *kernels;
+  LayoutKernelData kernel_data;
+  vector<double> dGH;
+
+  // Optional record of the optimizers' progress; not owned
+  LayoutTrace *trace;
+
+  // Optional wall-clock limit.  The optimizers check it once per
+  // iteration, and when it has passed they stop and leave x at the best
+  // layout they have seen.
+  bool has_deadline;
+  chrono::steady_clock::time_point deadline;
+
+  void SetDeadline(double milliseconds)
+  {
+    has_deadline = true;
+    deadline = chrono::steady_clock::now() +
+      chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<double, milli>(milliseconds));
+  }
+  bool DeadlinePassed() const
+  {
+    return has_deadline && (chrono::steady_clock::now() >= deadline);
+  }
+
+  GraphLayout(int num_nodes_, double image_size_x);
+
+  void Preprocess();
+
+  void computeB(const vector<double> &x, int begin, int end);
+  void computeA(const vector<double> &x, int begin, int end);
+  void computeL(const vector<double> &x, int begin, int end);
+  void computeG(const vector<double> &x, int begin, int end);
+  void computeH(const vector<double> &x, int begin, int end);
+  void computeB(const vector<double> &x) { computeB(x, 0, num_nodes); }
+  void computeA(const vector<double> &x) { computeA(x, 0, num_nodes); }
+  void computeL(const vector<double> &x) { computeL(x, 0, num_nodes); }
+  void computeG(const vector<double> &x) { computeG(x, 0, num_nodes); }
+  void computeH(const vector<double> &x) { computeH(x, 0, num_nodes); }
+  double computeF(const vector<double> &x);
+  LayoutTerms computeTerms(const vector<double> &x);
+  void gradientF(const vector<double> &x, vector<double> &dx);
+  // Largest difference between gradientF() and central differences of
+  // computeF(), relative to the largest gradient component, and the node
+  // it is at; 2n evaluations of F, so only for checking
+  double GradientError(const vector<double> &x, int &worst);
+
+  double FollowGradient(vector<double> &x, double step);
+
+  // Fixed schedule of normalized gradient steps with linearly shrinking
+  // step size; node 0 is pinned at 0
+  LayoutResult Descend(vector<double> &x, int total_iterations);
+
+  // Limited-memory BFGS with a strong Wolfe line search; stops when the
+  // relative objective change drops below f_tolerance or the gradient
+  // norm drops below g_tolerance * max(1, |x|)
+  LayoutResult MinimizeLBFGS(vector<double> &x, int max_iterations,
+                             double f_tolerance, double g_tolerance,
+                             int history = 8);
+
+  // Coarse-to-fine L-BFGS: solves the tree cut after its first two
+  // levels, then adds one level at a time, hanging each new node off its
+  // parent's solved position before refining.  max_iterations applies to
+  // each stage; the result counts the iterations of all of them.
+  LayoutResult MinimizeMultilevel(vector<double> &x, int max_iterations,
+                                  double f_tolerance, double g_tolerance);
+
+  // Direct engine, a heuristic: sweeps the levels top-down then bottom-up,
+  // fitting each level to its B and L terms with the others held fixed.
+  // Sibling spacing and the canvas edges are hard constraints instead of
+  // the G and H barriers, so each level is an isotonic regression.  The
+  // parent's L term couples all siblings through A[] and is only
+  // approximated, so a level is not solved exactly and a settled layout
+  // need not be a minimum.  Stops after max_sweeps, or once no node moves
+  // more than tolerance, which is reported as converged.
+  LayoutResult SolveDirect(vector<double> &x, int max_sweeps,
+                           double tolerance);
+
+private:
+  template <typename Job>
+  void ForBlocks(const Job &job)
+  {
+    function<void(int)> run_block = [&](int block)
+    {
+      int begin = block * block_size;
+      job(block, begin, min(begin + block_size, num_nodes));
+    };
+    if (workers)
+      workers->Run(block_sum.size(), run_block);
+    else
+      for (int block = 0; block < block_sum.size(); ++block)
+        run_block(block);
+  }
+
+  double SumBlocks() const;
+
+  // Adds a trace record if there is a trace and the iteration is due (or
+  // always if force); a negative gradient_norm is computed here
+  void Trace(int iteration, const vector<double> &x, double gradient_norm,
+             double step, bool force = false);
+
+  double SolveLevel(const vector<int> &level, const vector<double> &child_w,
+                    vector<double> &x);
+
+  double EvaluateStep(const vector<double> &x, const vector<double> &d,
+                      double step, vector<double> &x_new,
+                      vector<double> &g_new, double &dg_new);
+  double LineSearch(const vector<double> &x, double f, double dg,
+                    const vector<double> &d, double step,
+                    vector<double> &x_new, double &f_new,
+                    vector<double> &g_new);
+};
+
+#endif
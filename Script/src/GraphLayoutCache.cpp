@@ -0,0 +1,145 @@
+#include "System.h"
+#include "Utility.h"
+#include "GraphLayoutCache.h"
+
+
+const uint32 layout_cache_version = 1;
+
+string LayoutCacheStatusName(LayoutCacheStatus status)
+{
+  switch (status)
+  {
+  case LayoutCacheMiss:
+    return "miss";
+  case LayoutCacheNearHit:
+    return "near hit";
+  case LayoutCacheHit:
+    return "hit";
+  }
+  Assert(false);
+  return "";
+}
+
+uint64 LayoutCacheHash(uint64 h, const string &s)
+{
+  for (int i = 0; i < s.length(); ++i)
+  {
+    h ^= uint64((unsigned char)s[i]);
+    h *= 1099511628211ULL;
+  }
+  // terminator, so "ab","c" and "a","bc" differ
+  h ^= 0xFF;
+  h *= 1099511628211ULL;
+  return h;
+}
+
+uint64 LayoutCacheHash(uint64 h, uint64 v)
+{
+  for (int i = 0; i < 8; ++i)
+  {
+    h ^= (v >> (8 * i)) & 0xFF;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// sizes are keyed to 1/100 of a pixel, well below anything visible
+uint64 RoundSize(double x)
+{
+  return uint64(int64(floor(x * 100.0 + 0.5)));
+}
+
+void LayoutCacheShape(const GraphLayout &layout, LayoutCacheKey &key)
+{
+  uint64 h = LayoutCacheHash(layout_cache_seed, uint64(layout.num_nodes));
+  h = LayoutCacheHash(h, RoundSize(layout.min_x));
+  h = LayoutCacheHash(h, RoundSize(layout.max_x));
+  for (int i = 0; i < layout.num_nodes; ++i)
+  {
+    h = LayoutCacheHash(h, (i < key.nodes.size()) ? key.nodes[i] : 0);
+    h = LayoutCacheHash(h, uint64(int64(layout.p[i])));
+    h = LayoutCacheHash(h, uint64(int64(layout.l[i])));
+    h = LayoutCacheHash(h, RoundSize(layout.w[i]));
+    h = LayoutCacheHash(h, RoundSize(layout.t[i]));
+  }
+  key.shape = h;
+}
+
+string LayoutCacheFile(const string &dir, uint64 taxa)
+{
+  ostringstream name;
+  name << hex << setw(16) << setfill('0') << taxa << ".layout";
+  return RelPath(dir, name.str());
+}
+
+LayoutCacheStatus LoadLayoutCache(const string &dir, const LayoutCacheKey &key,
+                                  const GraphLayout &layout, vector<double> &x)
+{
+  ifstream in(LayoutCacheFile(dir, key.taxa).c_str(), ios::binary);
+  if (!in.is_open())
+    return LayoutCacheMiss;
+
+  uint32 version = 0;
+  uint64 taxa = 0, shape = 0;
+  vector<uint64> nodes;
+  vector<double> cached_x;
+  Read(in, version);
+  if (!in || (version != layout_cache_version))
+    return LayoutCacheMiss;
+  Read(in, taxa);
+  Read(in, shape);
+  Read(in, nodes);
+  Read(in, cached_x);
+  if (!in || (taxa != key.taxa) || (nodes.size() != cached_x.size()))
+    return LayoutCacheMiss;
+
+  if ((shape == key.shape) && (cached_x.size() == x.size()))
+  {
+    x = cached_x;
+    return LayoutCacheHit;
+  }
+
+  unordered_map<uint64, double> cached_pos;
+  for (int i = 0; i < nodes.size(); ++i)
+    cached_pos[nodes[i]] = cached_x[i];
+
+  // parents come before their children, so new nodes can be hung off
+  // their already placed parent in one pass; the seed is built in a copy
+  // so x is left alone on a miss
+  vector<double> seed = x;
+  int matched = 0;
+  for (int i = 0; i < layout.num_nodes; ++i)
+  {
+    unordered_map<uint64, double>::const_iterator iter =
+      cached_pos.find(key.nodes[i]);
+    if (iter != cached_pos.end())
+    {
+      seed[i] = iter->second;
+      ++matched;
+    }
+    else if (layout.p[i] >= 0)
+      seed[i] = seed[layout.p[i]] + layout.b[i];
+  }
+  if (matched == 0)
+    return LayoutCacheMiss;
+
+  seed[0] = 0.0;
+  x.swap(seed);
+  return LayoutCacheNearHit;
+}
+
+void SaveLayoutCache(const string &dir, const LayoutCacheKey &key,
+                     const vector<double> &x)
+{
+  MakeDir(dir);
+  string filename = LayoutCacheFile(dir, key.taxa);
+  if (!WriteFileAtomic(filename, [&](ostream &out)
+  {
+    Write(out, layout_cache_version);
+    Write(out, key.taxa);
+    Write(out, key.shape);
+    Write(out, key.nodes);
+    Write(out, x);
+  }))
+    cerr << "Cannot write layout cache " << filename << endl;
+}
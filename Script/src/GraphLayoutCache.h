@@ -0,0 +1,49 @@
+// GraphLayoutCache.h: Keeps solved layouts on disk so later renders of the
+// same taxonomy can start from them instead of from the packed initial guess
+
+#ifndef GRAPHLAYOUTCACHE_H
+#define GRAPHLAYOUTCACHE_H
+
+#include "System.h"
+#include "GraphLayout.h"
+
+struct LayoutCacheKey
+{
+  uint64 taxa;           // labels and parents of every input node, visible or not
+  uint64 shape;          // visible tree, rounded node widths, label heights, canvas
+  vector<uint64> nodes;  // per layout node, hash of its path of labels from the root
+
+  LayoutCacheKey() : taxa(0), shape(0) { }
+};
+
+enum LayoutCacheStatus
+{
+  LayoutCacheMiss,
+  LayoutCacheNearHit,
+  LayoutCacheHit
+};
+
+string LayoutCacheStatusName(LayoutCacheStatus status);
+
+// FNV-1a, chained through h; start from layout_cache_seed
+const uint64 layout_cache_seed = 14695981039346656037ULL;
+uint64 LayoutCacheHash(uint64 h, const string &s);
+uint64 LayoutCacheHash(uint64 h, uint64 v);
+
+// Fills in key.shape from the layout's structure and sizes; key.taxa and
+// key.nodes come from the caller, which knows the labels
+void LayoutCacheShape(const GraphLayout &layout, LayoutCacheKey &key);
+
+// Looks up the solution saved for key.taxa in dir.  On a hit x is replaced
+// by the cached solution.  On a near hit (same taxa, different sizes or
+// visible nodes) nodes found in the cache take their cached positions and
+// the others are placed at their parent's position plus b[]; layout must
+// have been preprocessed.  On a miss x is left alone.
+LayoutCacheStatus LoadLayoutCache(const string &dir, const LayoutCacheKey &key,
+                                  const GraphLayout &layout, vector<double> &x);
+
+// Saves x as the solution for key.taxa, replacing any older one
+void SaveLayoutCache(const string &dir, const LayoutCacheKey &key,
+                     const vector<double> &x);
+
+#endif
@@ -0,0 +1,141 @@
+// GraphLayoutKernels.cpp: Kernel data, runtime dispatch and the SSE2
+// versions of the GraphLayout penalty kernels.  The AVX2 versions are in
+// GraphLayoutKernelsAVX2.cpp, which is compiled with -mavx2 -mfma.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "GraphLayoutKernels.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+LayoutKernelData::LayoutKernelData()
+  : num_nodes(0), padded_nodes(0), Bw(0.0), G1w(0.0), G2w(0.0), Hw(0.0),
+    wB(NULL), b(NULL), gl(NULL), gr(NULL), g1off(NULL), g2off(NULL),
+    hmin(NULL), hmax(NULL), pidx(NULL), storage(NULL)
+{
+}
+
+LayoutKernelData::~LayoutKernelData()
+{
+  free(storage);
+}
+
+void LayoutKernelData::Allocate(int num_nodes_)
+{
+  free(storage);
+  storage = NULL;
+
+  num_nodes = num_nodes_;
+  padded_nodes = (num_nodes + 7) & ~7;
+  size_t array_bytes = size_t(padded_nodes) * sizeof(double);
+  size_t bytes = 8 * array_bytes + size_t(padded_nodes) * sizeof(int);
+  if (posix_memalign(&storage, 64, (bytes > 0) ? bytes : 64) != 0)
+  {
+    storage = NULL;
+    abort();
+  }
+  memset(storage, 0, bytes);
+
+  double *next = (double *)storage;
+  double **arrays[] = { &wB, &b, &gl, &gr, &g1off, &g2off, &hmin, &hmax };
+  for (int i = 0; i < 8; ++i)
+  {
+    *arrays[i] = next;
+    next += padded_nodes;
+  }
+  pidx = (int *)next;
+}
+
+
+#ifdef __SSE2__
+
+namespace
+{
+
+struct V
+{
+  static const int width = 2;
+  __m128d v;
+
+  V() { }
+  V(__m128d v_) : v(v_) { }
+  V(double x) : v(_mm_set1_pd(x)) { }
+  static V load(const double *p) { return V(_mm_loadu_pd(p)); }
+  static V gather(const double *x, const int *index)
+  {
+    return V(_mm_set_pd(x[index[1]], x[index[0]]));
+  }
+  static V left(const double *x, int i) { return V(_mm_loadu_pd(x + i - 1)); }
+  void store(double *p) const { _mm_storeu_pd(p, v); }
+  double sum() const { return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v))); }
+};
+
+inline V operator+(V a, V b) { return V(_mm_add_pd(a.v, b.v)); }
+inline V operator-(V a, V b) { return V(_mm_sub_pd(a.v, b.v)); }
+inline V operator*(V a, V b) { return V(_mm_mul_pd(a.v, b.v)); }
+inline V madd(V a, V b, V c) { return V(_mm_add_pd(_mm_mul_pd(a.v, b.v), c.v)); }
+inline V vmin(V a, V b) { return V(_mm_min_pd(a.v, b.v)); }
+inline V vmax(V a, V b) { return V(_mm_max_pd(a.v, b.v)); }
+inline V round(V a)
+{
+  __m128d magic = _mm_set1_pd(6755399441055744.0);
+  return V(_mm_sub_pd(_mm_add_pd(a.v, magic), magic));
+}
+inline V pow2(V n)
+{
+  // n + 1023 lands in the low mantissa bits, then moves to the exponent
+  __m128d t = _mm_add_pd(n.v, _mm_set1_pd(4503599627370496.0 + 1023.0));
+  return V(_mm_castsi128_pd(_mm_slli_epi64(_mm_castpd_si128(t), 52)));
+}
+
+#include "GraphLayoutKernels.inc"
+
+}
+
+const LayoutKernels layout_kernels_sse2 =
+{
+  "sse2",
+  KernelObjective,
+  KernelResiduals,
+  KernelGradient
+};
+
+bool LayoutKernelsSSE2Supported()
+{
+  return true;
+}
+
+double LayoutExp(double x)
+{
+  return VecExp(V1(x)).v;
+}
+
+#else
+
+const LayoutKernels layout_kernels_sse2 = { "sse2", NULL, NULL, NULL };
+
+bool LayoutKernelsSSE2Supported()
+{
+  return false;
+}
+
+double LayoutExp(double x)
+{
+  return exp(x);
+}
+
+#endif
+
+
+bool LayoutKernelsAVX2Supported()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,70 @@
+// GraphLayoutKernels.h: Vectorized B/G/H penalty kernels for GraphLayout
+//
+// This header is also included by the AVX2 translation unit, which is
+// compiled with -mavx2, so it must not pull in any library code that could
+// get instantiated there with AVX2 instructions.
+
+#ifndef GRAPHLAYOUTKERNELS_H
+#define GRAPHLAYOUTKERNELS_H
+
+// Per-node constants of the B, G and H terms in structure-of-arrays form.
+// Every array is padded to a multiple of 8 nodes and 64-byte aligned.  The
+// kernels rely on siblings being numbered consecutively, so that a node's
+// left neighbour is always the node before it.
+struct LayoutKernelData
+{
+  int num_nodes, padded_nodes;
+  double Bw, G1w, G2w, Hw;
+
+  double *wB;     // w[i], or 0 for the root
+  double *b;      // offset from the parent's center
+  double *gl;     // 1 if the node has a left neighbour, else 0
+  double *gr;     // 1 if the node has a right neighbour, else 0
+  double *g1off;  // 0.5*(w[i] + w[l[i]]) + min_space
+  double *g2off;  // 0.5*max(w[i] + w[l[i]], t[i] + t[l[i]]) + min_space
+  double *hmin;   // min_x + 0.5*max(w[i], t[i])
+  double *hmax;   // max_x - 0.5*max(w[i], t[i])
+  int *pidx;      // parent, or 0 for the root
+
+  LayoutKernelData();
+  ~LayoutKernelData();
+  void Allocate(int num_nodes_);
+
+private:
+  void *storage;
+
+  LayoutKernelData(const LayoutKernelData &);
+  LayoutKernelData &operator=(const LayoutKernelData &);
+};
+
+// The kernels work on nodes [begin, end).  objective and residuals fill in
+// G1, G2, H1 and H2 like GraphLayout::computeG/computeH; objective fills in
+// B and returns the block's B, G and H penalty total, residuals fills in
+// rB[i] = x[i] - (x[p[i]] + b[i]).  gradient writes the G and H part of
+// the derivative for each node into dGH.
+struct LayoutKernels
+{
+  const char *name;
+  double (*objective)(const LayoutKernelData &d, const double *x,
+                      int begin, int end, double *B,
+                      double *G1, double *G2, double *H1, double *H2);
+  void (*residuals)(const LayoutKernelData &d, const double *x,
+                    int begin, int end, double *rB,
+                    double *G1, double *G2, double *H1, double *H2);
+  void (*gradient)(const LayoutKernelData &d,
+                   const double *G1, const double *G2,
+                   const double *H1, const double *H2,
+                   int begin, int end, double *dGH);
+};
+
+extern const LayoutKernels layout_kernels_sse2;
+extern const LayoutKernels layout_kernels_avx2;
+
+bool LayoutKernelsSSE2Supported();
+bool LayoutKernelsAVX2Supported();
+
+// exp(x) with relative error below 1e-15 for x in [-708, 709]; arguments
+// outside that range are clamped to it
+double LayoutExp(double x);
+
+#endif
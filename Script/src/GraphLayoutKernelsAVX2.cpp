@@ -0,0 +1,69 @@
+// GraphLayoutKernelsAVX2.cpp: AVX2/FMA versions of the GraphLayout penalty
+// kernels.  Compiled with -mavx2 -mfma and only called after
+// LayoutKernelsAVX2Supported(), so nothing else may be defined here.
+
+#include <stddef.h>
+#include <math.h>
+#include "GraphLayoutKernels.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+
+namespace
+{
+
+struct V
+{
+  static const int width = 4;
+  __m256d v;
+
+  V() { }
+  V(__m256d v_) : v(v_) { }
+  V(double x) : v(_mm256_set1_pd(x)) { }
+  static V load(const double *p) { return V(_mm256_loadu_pd(p)); }
+  static V gather(const double *x, const int *index)
+  {
+    return V(_mm256_i32gather_pd(x, _mm_loadu_si128((const __m128i *)index), 8));
+  }
+  static V left(const double *x, int i) { return V(_mm256_loadu_pd(x + i - 1)); }
+  void store(double *p) const { _mm256_storeu_pd(p, v); }
+  double sum() const
+  {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+  }
+};
+
+inline V operator+(V a, V b) { return V(_mm256_add_pd(a.v, b.v)); }
+inline V operator-(V a, V b) { return V(_mm256_sub_pd(a.v, b.v)); }
+inline V operator*(V a, V b) { return V(_mm256_mul_pd(a.v, b.v)); }
+inline V madd(V a, V b, V c) { return V(_mm256_fmadd_pd(a.v, b.v, c.v)); }
+inline V vmin(V a, V b) { return V(_mm256_min_pd(a.v, b.v)); }
+inline V vmax(V a, V b) { return V(_mm256_max_pd(a.v, b.v)); }
+inline V round(V a)
+{
+  return V(_mm256_round_pd(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+inline V pow2(V n)
+{
+  // n + 1023 lands in the low mantissa bits, then moves to the exponent
+  __m256d t = _mm256_add_pd(n.v, _mm256_set1_pd(4503599627370496.0 + 1023.0));
+  return V(_mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(t), 52)));
+}
+
+#include "GraphLayoutKernels.inc"
+
+}
+
+const LayoutKernels layout_kernels_avx2 =
+{
+  "avx2",
+  KernelObjective,
+  KernelResiduals,
+  KernelGradient
+};
+
+#else
+
+const LayoutKernels layout_kernels_avx2 = { "avx2", NULL, NULL, NULL };
+
+#endif
@@ -0,0 +1,64 @@
+#include "System.h"
+#include "Utility.h"
+#include "GraphLayoutTrace.h"
+
+
+LayoutTrace::LayoutTrace(int every_)
+  : every(max(every_, 1)), stage(0), start(chrono::steady_clock::now())
+{
+}
+
+double LayoutTrace::Seconds() const
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool LayoutTrace::Write(const string &filename) const
+{
+  bool json = (GetLower(GetExtension(filename)) == "json");
+  if (!WriteFileAtomic(filename, [&](ostream &out)
+  {
+    if (json)
+      WriteJSON(out);
+    else
+      WriteCSV(out);
+  }))
+  {
+    cerr << "Cannot write layout trace " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+void LayoutTrace::WriteCSV(ostream &out) const
+{
+  out << "stage,iteration,seconds,objective,B,L,G,H,gradient,step" << endl;
+  out << setprecision(10);
+  for (int i = 0; i < records.size(); ++i)
+  {
+    const LayoutTraceRecord &r = records[i];
+    out << r.stage << "," << r.iteration << "," << r.seconds << ","
+        << r.terms.Total() << "," << r.terms.B << "," << r.terms.L << ","
+        << r.terms.G << "," << r.terms.H << "," << r.gradient_norm << ","
+        << r.step << endl;
+  }
+}
+
+void LayoutTrace::WriteJSON(ostream &out) const
+{
+  out << "[" << endl;
+  out << setprecision(10);
+  for (int i = 0; i < records.size(); ++i)
+  {
+    const LayoutTraceRecord &r = records[i];
+    out << "  {\"stage\": " << r.stage << ", \"iteration\": " << r.iteration
+        << ", \"seconds\": " << r.seconds
+        << ", \"objective\": " << r.terms.Total()
+        << ", \"B\": " << r.terms.B << ", \"L\": " << r.terms.L
+        << ", \"G\": " << r.terms.G << ", \"H\": " << r.terms.H
+        << ", \"gradient\": " << r.gradient_norm
+        << ", \"step\": " << r.step << "}"
+        << (((i + 1) < records.size()) ? "," : "") << endl;
+  }
+  out << "]" << endl;
+}
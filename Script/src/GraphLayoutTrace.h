@@ -0,0 +1,52 @@
+// GraphLayoutTrace.h: Per-iteration record of a layout solve, for finding
+// out where the optimizers spend their iterations
+
+#ifndef GRAPHLAYOUTTRACE_H
+#define GRAPHLAYOUTTRACE_H
+
+#include "System.h"
+
+// The layout objective split into its weighted terms
+struct LayoutTerms
+{
+  double B, L, G, H;
+
+  LayoutTerms() : B(0.0), L(0.0), G(0.0), H(0.0) { }
+  double Total() const { return B + L + G + H; }
+};
+
+struct LayoutTraceRecord
+{
+  int stage;             // multilevel stage (number of levels), else 0
+  int iteration;         // iteration, or sweep of the direct optimizer
+  double seconds;        // wall time since the trace was started
+  LayoutTerms terms;
+  double gradient_norm;
+  double step;           // distance the nodes moved in this iteration
+};
+
+class LayoutTrace
+{
+public:
+  // every: record one iteration in this many; the first and last
+  // iterations of a solve are always recorded
+  LayoutTrace(int every_);
+
+  int every;
+  int stage;
+  vector<LayoutTraceRecord> records;
+
+  bool Due(int iteration) const { return (iteration % every) == 0; }
+  double Seconds() const;
+
+  // JSON if filename ends in .json, else CSV.  Returns false, with a
+  // message, if the file could not be written.
+  bool Write(const string &filename) const;
+  void WriteCSV(ostream &out) const;
+  void WriteJSON(ostream &out) const;
+
+private:
+  chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -3,19 +3,78 @@
 #include "Utility.h"
 #include "Params.h"
 #include "DGNode.h"
+#include "Classification.h"
+#include "GraphLayout.h"
+#include "GraphLayoutCache.h"
+#include "TextMetrics.h"
+#include "FontStyles.h"
+#include "PngWriter.h"
+#include "RenderSocket.h"
+#include "RenderCache.h"
 #ifdef CAIRO
 #include <cairo.h>
 #include <cairo-ps.h>
 #include <cairo-pdf.h>
+#include <cairo-svg.h>
 #else
 #error Must compile with cairo!
 #endif
 
+enum LabelHalo
+{
+  LabelHaloOffset,
+  LabelHaloStroke
+};
+
+LabelHalo ParseLabelHalo(const string &name)
+{
+  string lower = GetLower(name);
+  if (lower == "offset")
+    return LabelHaloOffset;
+  else if (lower == "stroke")
+    return LabelHaloStroke;
+
+  cerr << "Unknown label_halo: " << name << endl;
+  Exit(1);
+  return LabelHaloOffset;
+}
+
 Params params;
 
 string input_file, output_file;
+bool input_table = false;
 string phylogeny_structure_file;
 
+LayoutOptimizer layout_optimizer = LayoutDescent;
+int layout_iterations = 20000;
+double layout_f_tolerance = 1e-10;
+double layout_g_tolerance = 1e-6;
+int layout_sweeps = 100;
+double layout_sweep_tolerance = 0.01;
+int layout_threads = 1;
+LayoutSimd layout_simd = LayoutSimdOff;
+string layout_cache;
+string layout_trace;
+int layout_trace_every = 100;
+double layout_deadline = 0.0;
+bool layout_check_gradient = false;
+string text_metrics_file;
+LabelHalo label_halo = LabelHaloOffset;
+int raster_threads = 1;
+int batch_threads = 1;
+string serve_socket;
+int serve_threads = 1;
+int serve_queue = 16;
+int serve_timeout = 30;
+int serve_max_size = 10000;
+double serve_max_pixels = 25e6;
+string render_cache;
+int64 render_cache_bytes = int64(256) << 20;
+RenderCacheKey render_cache_key;
+string output_format = "png";
+bool png_zlib = false;
+PngOptions png_options;
+
 void ParseFiles(string s, vector<string> &files)
 {
   bool list = false;
@@ -53,12 +112,109 @@ void InitParams()
   {
 	  cerr << exportedParams[i] << endl;
   }
-  params.Require(vector<string>(&required_param[0],
-                                &required_param[num_required_param]));
-
-  input_file = params["input"].GetString();
-  output_file = params["output"].GetString();
+  // a render server gets its inputs from render_client instead
+  if (params.Contains("serve_socket"))
+  {
+    serve_socket = params["serve_socket"].GetString();
+    params.Require("phylogeny_structure_file");
+  }
+  else
+  {
+    params.Require(vector<string>(&required_param[0],
+                                  &required_param[num_required_param]));
+    input_file = params["input"].GetString();
+    output_file = params["output"].GetString();
+  }
   phylogeny_structure_file = params["phylogeny_structure_file"].GetString();
+  if (params.Contains("input_format"))
+  {
+    string format = GetLower(params["input_format"].GetString());
+    if ((format != "nodes") && (format != "table"))
+    {
+      cerr << "Unknown input_format: " << format << endl;
+      Exit(1);
+    }
+    input_table = (format == "table");
+  }
+
+  if (params.Contains("layout_optimizer"))
+    layout_optimizer = ParseLayoutOptimizer(params["layout_optimizer"].GetString());
+  if (params.Contains("layout_iterations"))
+    layout_iterations = params["layout_iterations"].GetInt();
+  if (params.Contains("layout_f_tolerance"))
+    layout_f_tolerance = params["layout_f_tolerance"].GetDouble();
+  if (params.Contains("layout_g_tolerance"))
+    layout_g_tolerance = params["layout_g_tolerance"].GetDouble();
+  if (params.Contains("layout_sweeps"))
+    layout_sweeps = params["layout_sweeps"].GetInt();
+  if (params.Contains("layout_sweep_tolerance"))
+    layout_sweep_tolerance = params["layout_sweep_tolerance"].GetDouble();
+  if (params.Contains("layout_threads"))
+    layout_threads = params["layout_threads"].GetInt();
+  if (layout_threads <= 0)
+    layout_threads = HardwareThreads();
+  if (params.Contains("layout_simd"))
+    layout_simd = ParseLayoutSimd(params["layout_simd"].GetString());
+  if (params.Contains("layout_cache"))
+    layout_cache = params["layout_cache"].GetString();
+  if (params.Contains("layout_trace"))
+    layout_trace = params["layout_trace"].GetString();
+  if (params.Contains("layout_trace_every"))
+    layout_trace_every = params["layout_trace_every"].GetInt();
+  if (params.Contains("layout_deadline"))
+    layout_deadline = params["layout_deadline"].GetDouble();
+  if (params.Contains("layout_check_gradient"))
+    layout_check_gradient = (params["layout_check_gradient"].GetInt() != 0);
+  if (params.Contains("text_metrics_cache"))
+    text_metrics_file = params["text_metrics_cache"].GetString();
+  if (params.Contains("label_halo"))
+    label_halo = ParseLabelHalo(params["label_halo"].GetString());
+  if (params.Contains("raster_threads"))
+    raster_threads = params["raster_threads"].GetInt();
+  if (raster_threads <= 0)
+    raster_threads = HardwareThreads();
+  if (params.Contains("output_format"))
+    output_format = GetLower(params["output_format"].GetString());
+  if (params.Contains("png_encoder"))
+  {
+    string encoder = GetLower(params["png_encoder"].GetString());
+    if ((encoder != "cairo") && (encoder != "zlib"))
+    {
+      cerr << "Unknown png_encoder: " << encoder << endl;
+      Exit(1);
+    }
+    png_zlib = (encoder == "zlib");
+  }
+  if (params.Contains("png_level"))
+    png_options.level = params["png_level"].GetInt();
+  if (params.Contains("png_filter"))
+    png_options.filter = ParsePngFilter(params["png_filter"].GetString());
+  if (params.Contains("png_threads"))
+    png_options.threads = params["png_threads"].GetInt();
+  if (png_options.threads <= 0)
+    png_options.threads = HardwareThreads();
+  if (params.Contains("batch_threads"))
+    batch_threads = params["batch_threads"].GetInt();
+  if (batch_threads <= 0)
+    batch_threads = HardwareThreads();
+  if (params.Contains("serve_threads"))
+    serve_threads = params["serve_threads"].GetInt();
+  if (serve_threads <= 0)
+    serve_threads = HardwareThreads();
+  if (params.Contains("serve_queue"))
+    serve_queue = params["serve_queue"].GetInt();
+  if (serve_queue <= 0)
+    serve_queue = 1;
+  if (params.Contains("serve_timeout"))
+    serve_timeout = params["serve_timeout"].GetInt();
+  if (params.Contains("serve_max_size"))
+    serve_max_size = params["serve_max_size"].GetInt();
+  if (params.Contains("serve_max_pixels"))
+    serve_max_pixels = params["serve_max_pixels"].GetDouble();
+  if (params.Contains("render_cache"))
+    render_cache = params["render_cache"].GetString();
+  if (params.Contains("render_cache_mb"))
+    render_cache_bytes = int64(params["render_cache_mb"].GetInt()) << 20;
 }
 
 
@@ -155,18 +311,178 @@ string Parenthesize(const string &name, int depth)
 }
 
 
-string global_cairo_filename;
-cairo_t *global_cairo;
-cairo_surface_t *global_cairo_surface;
+// The surface one render draws on, and where the image goes once drawn
+struct CairoTarget
+{
+  string filename;
+  string format;
+  cairo_t *cairo;
+  cairo_surface_t *surface;
+  // when rasterizing in bands, cairo draws into this recording, which is
+  // replayed into surface at the end
+  cairo_surface_t *recording;
+  // where the image is written as it is encoded
+  ostream *stream;
+  // if set, the image is written here instead of to filename
+  ostream *output;
+  // if set, the image of each output is added here instead (recording only)
+  vector<string> *images;
+
+  CairoTarget()
+    : cairo(NULL), surface(NULL), recording(NULL), stream(NULL), output(NULL),
+      images(NULL) { }
+};
+
+// Output named "-" goes to stdout
+ostream *OpenOutputStream(const string &filename)
+{
+  if (filename == "-")
+    return &cout;
+  ostream *out = OutFileStream(filename);
+  AssertMsg(out, filename);
+  return out;
+}
+
+void CloseOutputStream(ostream *out)
+{
+  if (out == &cout)
+    cout.flush();
+  else
+    delete out;
+}
+
+void OpenTargetStream(CairoTarget &target)
+{
+  target.stream = target.output ? target.output : OpenOutputStream(target.filename);
+}
+
+void CloseTargetStream(CairoTarget &target)
+{
+  if (target.stream != target.output)
+    CloseOutputStream(target.stream);
+  target.stream = NULL;
+}
+
+cairo_status_t WriteCairoStream(void *closure, const unsigned char *data,
+                                unsigned int length)
+{
+  ostream *out = (ostream *)closure;
+  out->write((const char *)data, length);
+  return out->good() ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+// Writes an image surface as png, with cairo or with WritePNG for
+// png_encoder=zlib, or as raw pixels with no encoding:
+// "rgba" is 4 bytes per pixel, R, G, B, A, not premultiplied, row by row
+// with no header; "ppm" is a binary PPM (P6) of the image over white.
+void WriteImageSurface(cairo_surface_t *surface, const string &format,
+                       ostream &out)
+{
+  if ((format == "png") && !png_zlib)
+  {
+    Assert(cairo_surface_write_to_png_stream(surface, WriteCairoStream, &out) == CAIRO_STATUS_SUCCESS);
+    return;
+  }
+
+  cairo_surface_flush(surface);
+  const unsigned char *data = cairo_image_surface_get_data(surface);
+  int width = cairo_image_surface_get_width(surface);
+  int height = cairo_image_surface_get_height(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  if (format == "png")
+  {
+    Assert(WritePNG(out, data, width, height, stride, png_options));
+    return;
+  }
+  bool ppm = (format == "ppm");
+  if (ppm)
+    out << "P6\n" << width << " " << height << "\n255\n";
+
+  vector<unsigned char> row(width * (ppm ? 3 : 4));
+  for (int y = 0; y < height; ++y)
+  {
+    const uint32 *pixels = (const uint32 *)(data + y * stride);
+    unsigned char *dest = &row[0];
+    for (int x = 0; x < width; ++x)
+    {
+      uint32 a = pixels[x] >> 24;
+      uint32 r = (pixels[x] >> 16) & 0xff;
+      uint32 g = (pixels[x] >> 8) & 0xff;
+      uint32 b = pixels[x] & 0xff;
+      if (ppm)
+      {
+        // premultiplied, so over white is c + (255 - a)
+        *dest++ = r + (255 - a);
+        *dest++ = g + (255 - a);
+        *dest++ = b + (255 - a);
+      }
+      else
+      {
+        *dest++ = a ? (r * 255 + a / 2) / a : 0;
+        *dest++ = a ? (g * 255 + a / 2) / a : 0;
+        *dest++ = a ? (b * 255 + a / 2) / a : 0;
+        *dest++ = a;
+      }
+    }
+    out.write((const char *)&row[0], row.size());
+  }
+  Assert(out.good());
+}
+
+// Throws, rather than asserting, if cairo could not create surface, since
+// a render server request can ask for any size
+void CheckCairoSurface(cairo_surface_t *surface)
+{
+  cairo_status_t status = cairo_surface_status(surface);
+  if (status != CAIRO_STATUS_SUCCESS)
+  {
+    cairo_surface_destroy(surface);
+    throw runtime_error(string("Cannot create image: ") +
+                        cairo_status_to_string(status));
+  }
+}
+
+// Creates an eps, pdf or svg surface that writes to out as it is drawn,
+// so the document is never held in memory
+cairo_surface_t *CreateVectorSurface(const string &format, ostream &out,
+                                     double size_x, double size_y)
+{
+  cairo_surface_t *surface;
+  if (format == "eps")
+  {
+    surface = cairo_ps_surface_create_for_stream(WriteCairoStream, &out, size_x, size_y);
+    cairo_surface_set_fallback_resolution(surface, 600, 600);
+  }
+  else if (format == "pdf")
+    surface = cairo_pdf_surface_create_for_stream(WriteCairoStream, &out, size_x, size_y);
+  else if (format == "svg")
+    surface = cairo_svg_surface_create_for_stream(WriteCairoStream, &out, size_x, size_y);
+  else
+    Assert(false);
+  CheckCairoSurface(surface);
+  return surface;
+}
+
+// Finishes a vector surface, which writes out the rest of the document
+void FinishVectorSurface(cairo_surface_t *surface)
+{
+  cairo_surface_finish(surface);
+  Assert(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS);
+  cairo_surface_destroy(surface);
+}
 
 double cairo_scale_x, cairo_scale_y;
 
-cairo_t *InitCairoPNG(double view_size_x, double view_size_y,
+// format is png, rgba or ppm
+cairo_t *InitCairoPNG(CairoTarget &target,
+                      double view_size_x, double view_size_y,
                       const string &filename, 
                       int image_size_x, int image_size_y, 
-                      bool keep_aspect = false)
+                      bool keep_aspect = false,
+                      const string &format = "png")
 {
-  global_cairo_filename = filename;
+  target.filename = filename;
+  target.format = format;
 
   double cairo_scale_x = double(image_size_x) / view_size_x;
   double cairo_scale_y = double(image_size_y) / view_size_y;
@@ -177,34 +493,138 @@ cairo_t *InitCairoPNG(double view_size_x, double view_size_y,
     image_size_y = int(view_size_y * cairo_scale_y + 0.5);
   }
 
-  global_cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, image_size_x, image_size_y);
-  Assert(cairo_surface_status(global_cairo_surface) == CAIRO_STATUS_SUCCESS);
+  target.surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, image_size_x, image_size_y);
+  CheckCairoSurface(target.surface);
 
-  global_cairo = cairo_create(global_cairo_surface);
-  Assert(cairo_status(global_cairo) == CAIRO_STATUS_SUCCESS);
+  if (raster_threads > 1)
+  {
+    cairo_rectangle_t extents = { 0.0, 0.0, double(image_size_x), double(image_size_y) };
+    target.recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+    Assert(cairo_surface_status(target.recording) == CAIRO_STATUS_SUCCESS);
+    target.cairo = cairo_create(target.recording);
+  }
+  else
+    target.cairo = cairo_create(target.surface);
+  Assert(cairo_status(target.cairo) == CAIRO_STATUS_SUCCESS);
 
-  cairo_set_antialias(global_cairo, CAIRO_ANTIALIAS_GRAY);
-  cairo_scale(global_cairo, cairo_scale_x, cairo_scale_y);
-  cairo_save(global_cairo);
+  cairo_set_antialias(target.cairo, CAIRO_ANTIALIAS_GRAY);
+  cairo_scale(target.cairo, cairo_scale_x, cairo_scale_y);
+  cairo_save(target.cairo);
 
-  return global_cairo;
+  return target.cairo;
 }
 
-void FinalizeCairoPNG(cairo_t *cairo)
+// Replays a recording, scaled by scale, into horizontal bands of image on
+// num_threads threads.  Each band is an image surface over its own rows of
+// the image's buffer, so the bands clip the replay and need no stitching
+// afterwards.
+void RasterizeBands(cairo_surface_t *recording, cairo_surface_t *image,
+                    double scale, int num_threads)
 {
-  cairo_restore(global_cairo);
-  Assert(cairo_surface_write_to_png(global_cairo_surface, global_cairo_filename.c_str()) == CAIRO_STATUS_SUCCESS);
+  cairo_surface_flush(image);
+  unsigned char *data = cairo_image_surface_get_data(image);
+  int width = cairo_image_surface_get_width(image);
+  int height = cairo_image_surface_get_height(image);
+  int stride = cairo_image_surface_get_stride(image);
+
+  // a few bands per thread evens out bands with little drawn in them
+  int num_bands = max(min(4 * num_threads, height / 16), 1);
+  int band_height = (height + num_bands - 1) / num_bands;
+  num_bands = (height + band_height - 1) / band_height;
+
+  auto rasterize_band = [&](int band)
+  {
+    int y0 = band * band_height;
+    int rows = min(band_height, height - y0);
+    cairo_surface_t *band_surface = cairo_image_surface_create_for_data(
+      data + y0 * stride, CAIRO_FORMAT_ARGB32, width, rows, stride);
+    Assert(cairo_surface_status(band_surface) == CAIRO_STATUS_SUCCESS);
+    cairo_t *cairo = cairo_create(band_surface);
+    cairo_translate(cairo, 0.0, -double(y0));
+    cairo_scale(cairo, scale, scale);
+    cairo_set_source_surface(cairo, recording, 0.0, 0.0);
+    cairo_paint(cairo);
+    cairo_destroy(cairo);
+    cairo_surface_finish(band_surface);
+    cairo_surface_destroy(band_surface);
+  };
+
+  // the first replay builds the recording's spatial index, which is not
+  // safe to do from several threads at once
+  rasterize_band(0);
+  WorkerGroup workers(num_threads);
+  workers.Run(num_bands - 1, [&](int band) { rasterize_band(band + 1); });
+
+  cairo_surface_mark_dirty(image);
+}
+
+void FinalizeCairoPNG(CairoTarget &target)
+{
+  cairo_restore(target.cairo);
+  if (target.recording)
+  {
+    cairo_destroy(target.cairo);
+    target.cairo = NULL;
+    RasterizeBands(target.recording, target.surface, 1.0, raster_threads);
+    cairo_surface_destroy(target.recording);
+    target.recording = NULL;
+  }
+  OpenTargetStream(target);
+  WriteImageSurface(target.surface, target.format, *target.stream);
+  CloseTargetStream(target);
+
+  if (target.cairo)
+    cairo_destroy(target.cairo);
+  cairo_surface_destroy(target.surface);
+}
+
+cairo_t *InitCairoEPS(CairoTarget &target,
+                      double view_size_x, double view_size_y,
+                      const string &filename, 
+                      double image_size_x, double image_size_y, 
+                      bool keep_aspect = false)
+{
+  target.filename = filename;
+
+  double scale_x = double(image_size_x) / view_size_x;
+  double scale_y = double(image_size_y) / view_size_y;
+  if (keep_aspect)
+  {
+    scale_x = scale_y = min(scale_x, scale_y);
+    image_size_x = view_size_x * scale_x;
+    image_size_y = view_size_y * scale_y;
+  }
+
+  OpenTargetStream(target);
+  target.surface = CreateVectorSurface("eps", *target.stream, image_size_x, image_size_y);
+
+  target.cairo = cairo_create(target.surface);
+  Assert(cairo_status(target.cairo) == CAIRO_STATUS_SUCCESS);
+
+  cairo_set_antialias(target.cairo, CAIRO_ANTIALIAS_GRAY);
+  cairo_scale(target.cairo, scale_x, scale_y);
+  cairo_save(target.cairo);
+
+  return target.cairo;
+}
 
-  cairo_destroy(global_cairo);
-  cairo_surface_destroy(global_cairo_surface);
+void FinalizeCairoEPS(CairoTarget &target)
+{
+  cairo_restore(target.cairo);
+  cairo_show_page(target.cairo);
+  cairo_destroy(target.cairo);
+  FinishVectorSurface(target.surface);
+  CloseTargetStream(target);
 }
 
-cairo_t *InitCairoEPS(double view_size_x, double view_size_y,
+
+cairo_t *InitCairoPDF(CairoTarget &target,
+                      double view_size_x, double view_size_y,
                       const string &filename, 
                       double image_size_x, double image_size_y, 
                       bool keep_aspect = false)
 {
-  global_cairo_filename = filename;
+  target.filename = filename;
 
   double scale_x = double(image_size_x) / view_size_x;
   double scale_y = double(image_size_y) / view_size_y;
@@ -215,35 +635,36 @@ cairo_t *InitCairoEPS(double view_size_x, double view_size_y,
     image_size_y = view_size_y * scale_y;
   }
 
-  global_cairo_surface = cairo_ps_surface_create(global_cairo_filename.c_str(), image_size_x, image_size_y);
-  Assert(cairo_surface_status(global_cairo_surface) == CAIRO_STATUS_SUCCESS);
+  OpenTargetStream(target);
+  target.surface = CreateVectorSurface("pdf", *target.stream, image_size_x, image_size_y);
 
-  global_cairo = cairo_create(global_cairo_surface);
-  Assert(cairo_status(global_cairo) == CAIRO_STATUS_SUCCESS);
+  target.cairo = cairo_create(target.surface);
+  Assert(cairo_status(target.cairo) == CAIRO_STATUS_SUCCESS);
 
-  cairo_set_antialias(global_cairo, CAIRO_ANTIALIAS_GRAY);
-  cairo_surface_set_fallback_resolution(global_cairo_surface, 600, 600);
-  cairo_scale(global_cairo, scale_x, scale_y);
-  cairo_save(global_cairo);
+  cairo_set_antialias(target.cairo, CAIRO_ANTIALIAS_GRAY);
+  cairo_scale(target.cairo, scale_x, scale_y);
+  cairo_save(target.cairo);
 
-  return global_cairo;
+  return target.cairo;
 }
 
-void FinalizeCairoEPS(cairo_t *cairo)
+void FinalizeCairoPDF(CairoTarget &target)
 {
-  cairo_restore(global_cairo);
-  cairo_show_page(global_cairo);
-  cairo_destroy(global_cairo);
-  cairo_surface_destroy(global_cairo_surface);
+  cairo_restore(target.cairo);
+  cairo_show_page(target.cairo);
+  cairo_destroy(target.cairo);
+  FinishVectorSurface(target.surface);
+  CloseTargetStream(target);
 }
 
 
-cairo_t *InitCairoPDF(double view_size_x, double view_size_y,
+cairo_t *InitCairoSVG(CairoTarget &target,
+                      double view_size_x, double view_size_y,
                       const string &filename, 
                       double image_size_x, double image_size_y, 
                       bool keep_aspect = false)
 {
-  global_cairo_filename = filename;
+  target.filename = filename;
 
   double scale_x = double(image_size_x) / view_size_x;
   double scale_y = double(image_size_y) / view_size_y;
@@ -254,25 +675,211 @@ cairo_t *InitCairoPDF(double view_size_x, double view_size_y,
     image_size_y = view_size_y * scale_y;
   }
 
-  global_cairo_surface = cairo_pdf_surface_create(global_cairo_filename.c_str(), image_size_x, image_size_y);
-  Assert(cairo_surface_status(global_cairo_surface) == CAIRO_STATUS_SUCCESS);
+  OpenTargetStream(target);
+  target.surface = CreateVectorSurface("svg", *target.stream, image_size_x, image_size_y);
+
+  target.cairo = cairo_create(target.surface);
+  Assert(cairo_status(target.cairo) == CAIRO_STATUS_SUCCESS);
+
+  cairo_set_antialias(target.cairo, CAIRO_ANTIALIAS_GRAY);
+  cairo_scale(target.cairo, scale_x, scale_y);
+  cairo_save(target.cairo);
+
+  return target.cairo;
+}
+
+void FinalizeCairoSVG(CairoTarget &target)
+{
+  cairo_restore(target.cairo);
+  cairo_show_page(target.cairo);
+  cairo_destroy(target.cairo);
+  FinishVectorSurface(target.surface);
+  CloseTargetStream(target);
+}
+
+
+// One image to write.  The format is png, eps, pdf, svg, or rgba or ppm
+// for raw pixels, taken from the extension; "-" writes to stdout in
+// output_format.  The size is in pixels for raster formats and points
+// otherwise; the graph is scaled to fit it keeping its aspect ratio.
+struct CairoOutput
+{
+  string filename;
+  string format;
+  double size_x, size_y;
+
+  bool Raster() const { return (format == "png") || (format == "rgba") || (format == "ppm"); }
+};
+
+// One file name, optionally followed by @WIDTHxHEIGHT.  Returns false,
+// with the reason in error, if the type or size is not understood.
+bool ParseOutput(const string &name, CairoOutput &out, string &error)
+{
+  out.filename = name;
+  string size;
+  size_t at = name.rfind('@');
+  if ((at != string::npos) && (at > 0))
+  {
+    out.filename = name.substr(0, at);
+    size = name.substr(at + 1);
+  }
+  if (out.filename == "-")
+    out.format = output_format;
+  else
+    out.format = GetLower(GetExtension(out.filename));
+  if (out.Raster())
+  {
+    out.size_x = 2079;
+    out.size_y = 1386;
+  }
+  else if ((out.format == "eps") || (out.format == "pdf") || (out.format == "svg"))
+  {
+    out.size_x = (11.0 - 2.0) * 300.0;
+    out.size_y = (8.5 - 2.0) * 300.0;
+  }
+  else
+  {
+    error = "Unknown output image file extension: " + out.format;
+    return false;
+  }
+  if (!size.empty())
+  {
+    size_t x = GetLower(size).find('x');
+    out.size_x = out.size_y = 0.0;
+    if (x != string::npos)
+    {
+      StrTo(size.substr(0, x), out.size_x);
+      StrTo(size.substr(x + 1), out.size_y);
+    }
+    if ((out.size_x <= 0.0) || (out.size_y <= 0.0))
+    {
+      error = "Bad output size: " + name;
+      return false;
+    }
+  }
+  return true;
+}
+
+// output is a comma separated list of files, each optionally followed by
+// @WIDTHxHEIGHT, e.g. "graph.png,graph.pdf,thumb.png@400x267"
+void ParseOutputs(const string &output, vector<CairoOutput> &outputs)
+{
+  outputs.clear();
+  vector<string> names;
+  SplitFields(output, names, ",");
+  for (int i = 0; i < names.size(); ++i)
+  {
+    CairoOutput out;
+    string error;
+    if (!ParseOutput(names[i], out, error))
+    {
+      cerr << error << endl;
+      Exit(1);
+    }
+    outputs.push_back(out);
+  }
+  if (outputs.empty())
+  {
+    cerr << "No output file given" << endl;
+    Exit(1);
+  }
+}
+
+// For several outputs the graph is drawn once into a recording, in view
+// units, and the recording is replayed into each output at its own scale.
+// Text drawn into a recording is measured without hinting, so it scales
+// the same way to every output.
+cairo_t *InitCairoRecording(CairoTarget &target, double view_size_x,
+                            double view_size_y)
+{
+  cairo_rectangle_t extents = { 0.0, 0.0, view_size_x, view_size_y };
+  target.recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  Assert(cairo_surface_status(target.recording) == CAIRO_STATUS_SUCCESS);
+  target.surface = NULL;
+
+  target.cairo = cairo_create(target.recording);
+  Assert(cairo_status(target.cairo) == CAIRO_STATUS_SUCCESS);
 
-  global_cairo = cairo_create(global_cairo_surface);
-  Assert(cairo_status(global_cairo) == CAIRO_STATUS_SUCCESS);
+  cairo_set_antialias(target.cairo, CAIRO_ANTIALIAS_GRAY);
+  cairo_save(target.cairo);
 
-  cairo_set_antialias(global_cairo, CAIRO_ANTIALIAS_GRAY);
-  cairo_scale(global_cairo, scale_x, scale_y);
-  cairo_save(global_cairo);
+  return target.cairo;
+}
+
+// Replays a recording made by InitCairoRecording as out, writing the
+// encoded image to stream rather than to out.filename
+void WriteCairoOutput(cairo_surface_t *recording, double view_size_x,
+                      double view_size_y, const CairoOutput &out,
+                      ostream &stream)
+{
+  double scale = min(out.size_x / view_size_x, out.size_y / view_size_y);
+
+  if (out.Raster())
+  {
+    int image_size_x = int(view_size_x * scale + 0.5);
+    int image_size_y = int(view_size_y * scale + 0.5);
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, image_size_x, image_size_y);
+    CheckCairoSurface(surface);
+    RasterizeBands(recording, surface, scale, raster_threads);
+    WriteImageSurface(surface, out.format, stream);
+    cairo_surface_destroy(surface);
+    return;
+  }
+
+  cairo_surface_t *surface = CreateVectorSurface(out.format, stream,
+                                                 view_size_x * scale,
+                                                 view_size_y * scale);
+  cairo_t *cairo = cairo_create(surface);
+  Assert(cairo_status(cairo) == CAIRO_STATUS_SUCCESS);
+  cairo_scale(cairo, scale, scale);
+  cairo_set_source_surface(cairo, recording, 0.0, 0.0);
+  cairo_paint(cairo);
+  cairo_show_page(cairo);
+  cairo_destroy(cairo);
+  cairo_surface_finish(surface);
+  Assert(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS);
+  cairo_surface_destroy(surface);
+}
 
-  return global_cairo;
+void WriteCairoOutput(cairo_surface_t *recording, double view_size_x,
+                      double view_size_y, const CairoOutput &out)
+{
+  ostream *stream = OpenOutputStream(out.filename);
+  WriteCairoOutput(recording, view_size_x, view_size_y, out, *stream);
+  CloseOutputStream(stream);
 }
 
-void FinalizeCairoPDF(cairo_t *cairo)
+// The encoded bytes of the image, for callers that pass images on in
+// memory instead of through a file
+string CairoOutputBytes(cairo_surface_t *recording, double view_size_x,
+                        double view_size_y, const CairoOutput &out)
 {
-  cairo_restore(global_cairo);
-  cairo_show_page(global_cairo);
-  cairo_destroy(global_cairo);
-  cairo_surface_destroy(global_cairo_surface);
+  ostringstream stream;
+  WriteCairoOutput(recording, view_size_x, view_size_y, out, stream);
+  return stream.str();
+}
+
+void FinalizeCairoRecording(CairoTarget &target, double view_size_x,
+                            double view_size_y,
+                            const vector<CairoOutput> &outputs)
+{
+  cairo_restore(target.cairo);
+  cairo_destroy(target.cairo);
+  target.cairo = NULL;
+
+  for (int i = 0; i < outputs.size(); ++i)
+    if (target.images)
+      target.images->push_back(CairoOutputBytes(target.recording, view_size_x,
+                                                view_size_y, outputs[i]));
+    else if (target.output)
+      WriteCairoOutput(target.recording, view_size_x, view_size_y,
+                       outputs[i], *target.output);
+    else
+      WriteCairoOutput(target.recording, view_size_x, view_size_y,
+                       outputs[i]);
+
+  cairo_surface_destroy(target.recording);
+  target.recording = NULL;
 }
 
 
@@ -282,12 +889,14 @@ struct RenderTextParams
   double y_offset;
   cairo_font_slant_t slant;
   cairo_font_weight_t weight;
+  int font;              // id in font_styles, set when the text is compiled
 
   RenderTextParams() { }
 
   RenderTextParams(double size_, double y_offset_, 
                    cairo_font_slant_t slant_, cairo_font_weight_t weight_)
-    : size(size_), y_offset(y_offset_), slant(slant_), weight(weight_)
+    : size(size_), y_offset(y_offset_), slant(slant_), weight(weight_),
+      font(-1)
   {
   }
 };
@@ -395,129 +1004,365 @@ void ParseRenderText(const string &text,
   Assert(params.size() == texts.size());
 }
 
-void RenderText(cairo_t *cairo, const string &font_face, double font_size,
-                int x_align, int y_align, const string &text)
+// A label split into runs of one style, each turned into glyphs and
+// measured, ready to be drawn any number of times without parsing,
+// measuring or allocating again
+struct CompiledText
 {
-/* ~~ = backspace
-   ~b0 = weight normal
-   ~b1 = weight bold
-   ~i0 = slant normal
-   ~i1 = slant italic
-   ~i2 = slant oblique
-   ~s0 = full script
-   ~s1 = super script
-   ~s2 = sub script
-   ~0 = normal everything
-*/
-  if (text.empty())
-    return;
+  vector<RenderTextParams> params;
+  vector< vector<cairo_glyph_t> > glyphs;   // placed from the run's origin
+  vector<double> run_x;                     // run origins from the first's
+  double font_height, text_left, text_right;
 
-  cairo_select_font_face(cairo, font_face.c_str(), CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-  cairo_set_font_size(cairo, font_size);
-  cairo_font_extents_t font_extents;
-  cairo_font_extents(cairo, &font_extents);
+  bool Empty() const { return params.empty(); }
+  double Width() const { return Empty() ? 0.0 : (text_right - text_left); }
+};
 
-  double font_height = font_extents.ascent - font_extents.descent;
+// Compiled labels of one font face, size and markup prefix, by their text,
+// so a repeat lookup finds the text as given and builds no key
+struct CompiledTextStyle
+{
+  string font_face;
+  double font_size;
+  string prefix;
+  unordered_map<string, CompiledText> texts;
+};
 
-  vector<RenderTextParams> params;
-  vector<string> texts;
-  ParseRenderText(text, params, texts, font_size, font_height);
-  
-  double text_left, text_right, text_x_offset = 0.0;
-  for (int i = 0; i < params.size(); ++i)
+// Styles are few, so they are searched in turn; a deque keeps the
+// references handed out to earlier labels valid as styles are added
+typedef deque<CompiledTextStyle> CompiledTexts;
+
+// shared by all renders of a run
+TextMetricsCache text_metrics;
+
+struct OutlineSegment;
+typedef vector<OutlineSegment> OutlinePath;
+
+// Fonts and compiled labels, which a thread that renders one job after
+// another can keep from job to job
+struct TextCache
+{
+  FontStyleRegistry font_styles;
+  CompiledTexts compiled_texts;
+};
+
+// Everything one render of a graph works on: its cairo target, the fonts
+// and compiled labels for that target, and the tree with its layout.
+// Renders only share the settings, the phylogeny structure and
+// text_metrics, so a batch can run one job on each thread.
+struct GraphJob
+{
+  string input_file, output_file;
+  bool input_table;
+  CairoTarget target;
+
+  TextCache own_text;
+  FontStyleRegistry &font_styles;
+  CompiledTexts &compiled_texts;
+
+  vector< vector<DGNode> > nodes;
+  vector<double> level_text_widths;
+  vector<double> level_x;
+  vector< vector<int> > node_index;
+  vector<int> level_nodes;
+  vector< vector<double> > node_y, node_height, node_width;
+  vector< vector<double> > node_y_top;
+  vector< vector<double> > node_y_offset;
+  vector< vector<double> > node_slope;
+  vector<uint32> level_color;
+
+  // text_cache, if given, is used instead of the job's own
+  GraphJob(const string &input_file_, const string &output_file_,
+           TextCache *text_cache = NULL)
+    : input_file(input_file_), output_file(output_file_),
+      input_table(::input_table),
+      font_styles(text_cache ? text_cache->font_styles : own_text.font_styles),
+      compiled_texts(text_cache ? text_cache->compiled_texts : own_text.compiled_texts)
+  {
+  }
+
+  // Reads input_file and draws it to output_file.  Returns false, with a
+  // message, if the input cannot be read or is invalid.
+  bool Render();
+  // Reads the levels, from a read table if input_table; false if they do
+  // not form a tree
+  bool ReadNodes(istream &in);
+  // Draws the levels to outputs, or to target.output if it is set
+  void Draw(const vector<CairoOutput> &outputs);
+  // Draws the levels into images, one per output, instead of their files
+  void DrawImages(const vector<CairoOutput> &outputs, vector<string> &images);
+  // Reads input and draws it into images.  With render_cache, images saved
+  // there are returned without reading or drawing anything, and new ones
+  // are saved.  Returns false if the input is invalid.
+  bool DrawInput(const string &input, const vector<CairoOutput> &outputs,
+                 vector<string> &images);
+
+  FontMetrics GetFontMetrics(const string &font_face, double font_size);
+  TextRunMetrics GetTextRunMetrics(const string &font_face,
+                                   const RenderTextParams &params,
+                                   const string &text);
+  // text is drawn after prefix, markup that the label does not need to
+  // be copied into, e.g. "~i1" for italics
+  const CompiledText &CompileRenderText(cairo_t *cairo, const string &font_face,
+                                        double font_size, const string &text,
+                                        const char *prefix = "");
+  void SetTextTarget(cairo_t *cairo);
+  void DrawGlyphs(cairo_t *cairo, const CompiledText &compiled,
+                  int x_align, int y_align, bool path);
+  void RenderText(cairo_t *cairo, const CompiledText &compiled,
+                  int x_align, int y_align);
+  void RenderTextPath(cairo_t *cairo, const CompiledText &compiled,
+                      int x_align, int y_align);
+  void RenderHaloText(cairo_t *cairo, const CompiledText &compiled,
+                      double x, double y, LabelHalo halo);
+  void RenderText(cairo_t *cairo, const string &font_face, double font_size,
+                  int x_align, int y_align, const string &text);
+  double RenderTextWidth(cairo_t *cairo, const string &font_face,
+                         double font_size, const string &text);
+  double RenderTextHeight(cairo_t *cairo, const string &font_face,
+                          double font_size);
+
+  void DrawLeftEdge(OutlinePath &path, int level, int i, uint32 edge);
+  void DrawLeftEdge(OutlinePath &path, int level, int i, int child);
+  void DrawRightEdge(OutlinePath &path, int level, int i);
+  void DrawCutRightEdge(OutlinePath &path, int level, int i, int child);
+  void DrawLastRightEdge(OutlinePath &path, int level, int i);
+  void DrawTopEdge(OutlinePath &path, int level, int i);
+  void DrawBottomEdge(OutlinePath &path, int level, int i);
+  void RecurseOutline(OutlinePath &path, int level, int i);
+  void TopOutline(OutlinePath &path);
+
+  LayoutCacheKey MakeLayoutCacheKey(const GraphLayout &layout);
+
+private:
+  GraphJob(const GraphJob &);
+  GraphJob &operator=(const GraphJob &);
+};
+
+FontMetrics GraphJob::GetFontMetrics(const string &font_face, double font_size)
+{
+  FontMetrics metrics;
+  if (!text_metrics.FindFont(font_styles.Target(), font_face, font_size,
+                             metrics))
   {
-    cairo_select_font_face(cairo, font_face.c_str(), 
-                           params[i].slant, params[i].weight);
-    cairo_set_font_size(cairo, params[i].size);
+    int font = font_styles.Find(font_face, CAIRO_FONT_SLANT_NORMAL,
+                                CAIRO_FONT_WEIGHT_NORMAL, font_size);
+    cairo_font_extents_t font_extents;
+    cairo_scaled_font_extents(font_styles.Font(font), &font_extents);
+    metrics.ascent = font_extents.ascent;
+    metrics.descent = font_extents.descent;
+    text_metrics.AddFont(font_styles.Target(), font_face, font_size, metrics);
+  }
+  return metrics;
+}
 
+TextRunMetrics GraphJob::GetTextRunMetrics(const string &font_face,
+                                           const RenderTextParams &params,
+                                           const string &text)
+{
+  TextRunMetrics metrics;
+  if (!text_metrics.FindRun(font_styles.Target(), font_face, params.size,
+                            params.slant, params.weight, text, metrics))
+  {
     cairo_text_extents_t extents;
-    cairo_text_extents(cairo, texts[i].c_str(), &extents);
-    
+    cairo_scaled_font_text_extents(font_styles.Font(params.font),
+                                   text.c_str(), &extents);
+    metrics.x_bearing = extents.x_bearing;
+    metrics.width = extents.width;
+    metrics.x_advance = extents.x_advance;
+    text_metrics.AddRun(font_styles.Target(), font_face, params.size,
+                        params.slant, params.weight, text, metrics);
+  }
+  return metrics;
+}
+
+const CompiledText &GraphJob::CompileRenderText(cairo_t *cairo,
+                                                const string &font_face,
+                                                double font_size,
+                                                const string &text,
+                                                const char *prefix)
+{
+  CompiledTextStyle *style = NULL;
+  for (int i = 0; i < compiled_texts.size(); ++i)
+  {
+    CompiledTextStyle &s = compiled_texts[i];
+    if ((s.font_size == font_size) && (s.font_face == font_face) &&
+        (s.prefix == prefix))
+    {
+      style = &s;
+      break;
+    }
+  }
+  if (!style)
+  {
+    compiled_texts.push_back(CompiledTextStyle());
+    style = &compiled_texts.back();
+    style->font_face = font_face;
+    style->font_size = font_size;
+    style->prefix = prefix;
+  }
+
+  unordered_map<string, CompiledText>::iterator iter = style->texts.find(text);
+  if (iter != style->texts.end())
+    return iter->second;
+
+  CompiledText &compiled = style->texts[text];
+  FontMetrics font_metrics = GetFontMetrics(font_face, font_size);
+  compiled.font_height = font_metrics.ascent - font_metrics.descent;
+  compiled.text_left = compiled.text_right = 0.0;
+
+  vector<string> texts;
+  ParseRenderText(prefix + text, compiled.params, texts, font_size,
+                  compiled.font_height);
+  compiled.glyphs.resize(texts.size());
+  compiled.run_x.resize(texts.size());
+
+  // the left and right ink edges of the whole
+  double text_x_offset = 0.0;
+  for (int i = 0; i < compiled.params.size(); ++i)
+  {
+    RenderTextParams &params = compiled.params[i];
+    params.font = font_styles.Find(font_face, params.slant, params.weight,
+                                   params.size);
+    TextRunMetrics extents = GetTextRunMetrics(font_face, params, texts[i]);
     if (i == 0)
-      text_left = extents.x_bearing;
-    if (i == (params.size() - 1))
-      text_right = text_x_offset + extents.x_bearing + extents.width;
+      compiled.text_left = extents.x_bearing;
+    if (i == (compiled.params.size() - 1))
+      compiled.text_right = text_x_offset + extents.x_bearing + extents.width;
+
+    cairo_glyph_t *glyphs = NULL;
+    int num_glyphs = 0;
+    if (cairo_scaled_font_text_to_glyphs(font_styles.Font(params.font),
+                                         0.0, 0.0, texts[i].data(),
+                                         texts[i].length(), &glyphs,
+                                         &num_glyphs, NULL, NULL, NULL) ==
+        CAIRO_STATUS_SUCCESS)
+      compiled.glyphs[i].assign(glyphs, glyphs + num_glyphs);
+    cairo_glyph_free(glyphs);
+    compiled.run_x[i] = text_x_offset;
 
     text_x_offset += extents.x_advance;
   }
+  return compiled;
+}
+
+// Fonts, and with them text metrics, depend on the surface type and the
+// device scale, so compiled text is only reused for the same target
+void GraphJob::SetTextTarget(cairo_t *cairo)
+{
+  string old_target = font_styles.Target();
+  font_styles.SetTarget(cairo, target.surface);
+  if (font_styles.Target() != old_target)
+    compiled_texts.clear();
+}
 
+void MoveToTextOrigin(cairo_t *cairo, const CompiledText &compiled,
+                      int x_align, int y_align)
+{
   if (x_align > 0)
-    cairo_rel_move_to(cairo, -text_left, 0.0);
+    cairo_rel_move_to(cairo, -compiled.text_left, 0.0);
   else if (x_align < 0)
-    cairo_rel_move_to(cairo, -text_right, 0.0);
+    cairo_rel_move_to(cairo, -compiled.text_right, 0.0);
   else
-    cairo_rel_move_to(cairo, -0.5 * (text_left + text_right), 0.0);
+    cairo_rel_move_to(cairo, -0.5 * (compiled.text_left + compiled.text_right), 0.0);
 
   if (y_align > 0)
-    cairo_rel_move_to(cairo, 0.0, font_height);
+    cairo_rel_move_to(cairo, 0.0, compiled.font_height);
   else if (y_align < 0)
     cairo_rel_move_to(cairo, 0.0, 0.0);
   else
-    cairo_rel_move_to(cairo, 0.0, 0.5 * font_height);
+    cairo_rel_move_to(cairo, 0.0, 0.5 * compiled.font_height);
+}
+
+// The glyphs of each run are placed from the origin, so rather than
+// copying them to where they go the user space is moved there while they
+// are drawn, or added to the path if path
+void GraphJob::DrawGlyphs(cairo_t *cairo, const CompiledText &compiled,
+                          int x_align, int y_align, bool path)
+{
+  if (compiled.Empty())
+    return;
 
-  for (int i = 0; i < params.size(); ++i)
+  MoveToTextOrigin(cairo, compiled, x_align, y_align);
+  double x, y;
+  cairo_get_current_point(cairo, &x, &y);
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cairo, &matrix);
+  for (int i = 0; i < compiled.params.size(); ++i)
   {
-    cairo_select_font_face(cairo, font_face.c_str(),
-                           params[i].slant, params[i].weight);
-    cairo_set_font_size(cairo, params[i].size);
+    const RenderTextParams &params = compiled.params[i];
+    const vector<cairo_glyph_t> &glyphs = compiled.glyphs[i];
+    if (glyphs.empty())
+      continue;
+    cairo_set_scaled_font(cairo, font_styles.Font(params.font));
 
-    cairo_rel_move_to(cairo, 0.0, params[i].y_offset);
-    cairo_show_text(cairo, texts[i].c_str());
-    cairo_rel_move_to(cairo, 0.0, -params[i].y_offset);
+    cairo_translate(cairo, x + compiled.run_x[i], y + params.y_offset);
+    if (path)
+      cairo_glyph_path(cairo, &glyphs[0], glyphs.size());
+    else
+      cairo_show_glyphs(cairo, &glyphs[0], glyphs.size());
+    cairo_set_matrix(cairo, &matrix);
   }
 }
 
-
-double RenderTextWidth(cairo_t *cairo, const string &font_face, 
-                       double font_size, const string &text)
+void GraphJob::RenderText(cairo_t *cairo, const CompiledText &compiled,
+                          int x_align, int y_align)
 {
-/* ~~ = backspace
-   ~b0 = weight normal
-   ~b1 = weight bold
-   ~i0 = slant normal
-   ~i1 = slant italic
-   ~i2 = slant oblique
-   ~s0 = full script
-   ~s1 = super script
-   ~s2 = sub script
-   ~0 = normal everything
-*/
-  cairo_select_font_face(cairo, font_face.c_str(), CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-  cairo_set_font_size(cairo, font_size);
-  cairo_font_extents_t font_extents;
-  cairo_font_extents(cairo, &font_extents);
-
-  double font_height = font_extents.ascent - font_extents.descent;
+  DrawGlyphs(cairo, compiled, x_align, y_align, false);
+}
 
-  vector<RenderTextParams> params;
-  vector<string> texts;
-  ParseRenderText(text, params, texts, font_size, font_height);
-  if (params.empty())
-    return 0.0;
+// Adds the glyph outlines of the text to the current path instead of
+// drawing them, so they can be stroked and filled
+void GraphJob::RenderTextPath(cairo_t *cairo, const CompiledText &compiled,
+                              int x_align, int y_align)
+{
+  DrawGlyphs(cairo, compiled, x_align, y_align, true);
+}
 
-  double text_left, text_right, text_x_offset = 0.0;
-  for (int i = 0; i < params.size(); ++i)
+// Draws text in black with a white halo so it stays readable over the
+// bands.  LabelHaloOffset draws four white copies offset by half a pixel
+// under the text; LabelHaloStroke builds the glyph outlines once, strokes
+// them with a wide white pen and fills them, which draws each glyph once
+// instead of five times.
+void GraphJob::RenderHaloText(cairo_t *cairo, const CompiledText &compiled,
+                              double x, double y, LabelHalo halo)
+{
+  if (halo == LabelHaloStroke)
   {
-    cairo_select_font_face(cairo, font_face.c_str(), 
-                           params[i].slant, params[i].weight);
-    cairo_set_font_size(cairo, params[i].size);
-
-    cairo_text_extents_t extents;
-    cairo_text_extents(cairo, texts[i].c_str(), &extents);
-    
-    if (i == 0)
-      text_left = extents.x_bearing;
-    if (i == (params.size() - 1))
-      text_right = text_x_offset + extents.x_bearing + extents.width;
-
-    text_x_offset += extents.x_advance;
+    cairo_save(cairo);
+    cairo_new_path(cairo);
+    cairo_move_to(cairo, x, y);
+    RenderTextPath(cairo, compiled, 0, 0);
+    cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 0.8);
+    cairo_set_line_width(cairo, 1.5);
+    cairo_set_line_join(cairo, CAIRO_LINE_JOIN_ROUND);
+    cairo_stroke_preserve(cairo);
+    cairo_set_source_rgba(cairo, 0.0, 0.0, 0.0, 1.0);
+    cairo_fill(cairo);
+    cairo_restore(cairo);
+    return;
   }
- 
-  return (text_right - text_left);
+
+  cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 0.4);
+  cairo_move_to(cairo, x + 0.5, y + 0.5);
+  RenderText(cairo, compiled, 0, 0);
+  cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 0.4);
+  cairo_move_to(cairo, x + 0.5, y - 0.5);
+  RenderText(cairo, compiled, 0, 0);
+  cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 0.4);
+  cairo_move_to(cairo, x - 0.5, y + 0.5);
+  RenderText(cairo, compiled, 0, 0);
+  cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 0.4);
+  cairo_move_to(cairo, x - 0.5, y - 0.5);
+  RenderText(cairo, compiled, 0, 0);
+  cairo_set_source_rgba(cairo, 0.0, 0.0, 0.0, 1.0);
+  cairo_move_to(cairo, x, y);
+  RenderText(cairo, compiled, 0, 0);
 }
 
-double RenderTextHeight(cairo_t *cairo, const string &font_face, 
-                       double font_size)
+void GraphJob::RenderText(cairo_t *cairo, const string &font_face,
+                          double font_size, int x_align, int y_align,
+                          const string &text)
 {
 /* ~~ = backspace
    ~b0 = weight normal
@@ -530,292 +1375,59 @@ double RenderTextHeight(cairo_t *cairo, const string &font_face,
    ~s2 = sub script
    ~0 = normal everything
 */
-  cairo_select_font_face(cairo, font_face.c_str(), CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-  cairo_set_font_size(cairo, font_size);
-  cairo_font_extents_t font_extents;
-  cairo_font_extents(cairo, &font_extents);
-
-  double font_height = font_extents.ascent - font_extents.descent;
-  return font_height;
-}
-
-#if 1
-double view_size_x = 1000;
-double view_size_y = (1800.0/2700.0) * view_size_x;
-#else
-double view_size_x = 2078;
-double view_size_y = (1800.0/2700.0) * view_size_x;
-#endif
-
-
-
-
-vector< vector<DGNode> > nodes;
-
-
-double sqr(double x)
-{
-  return x * x;
-}
+  if (text.empty())
+    return;
 
-double negsqr(double x)
-{
-  if (x < 0.0)
-    return x * x;
-  else
-    return 0.0;
+  RenderText(cairo, CompileRenderText(cairo, font_face, font_size, text),
+             x_align, y_align);
 }
 
-double dnegsqr(double x)
-{
-  if (x < 0.0)
-    return 2.0 * x;
-  else
-    return 0.0;
-}
 
-struct GraphLayout
+double GraphJob::RenderTextWidth(cairo_t *cairo, const string &font_face, 
+                                 double font_size, const string &text)
 {
-  int num_nodes;
-  vector<double> w, t, b, B, A, L, G1, G2, H1, H2;
-  vector<int> p, l, r;
-  vector< set<int> > C;
-  double Bw, Lw, G1w, G2w, Hw;
-  double min_space, min_x, max_x;
-  static constexpr double graph_branch_sep = 10.0;
-
-  GraphLayout(int num_nodes_, double image_size_x)
-    : num_nodes(num_nodes_), w(num_nodes), t(num_nodes), b(num_nodes),
-      B(num_nodes), A(num_nodes), L(num_nodes), 
-      G1(num_nodes), G2(num_nodes), H1(num_nodes), H2(num_nodes),
-      p(num_nodes, -1), l(num_nodes, -1), r(num_nodes, -1), C(num_nodes),
-      Bw(1.0), Lw(3.0), G1w(1.0), G2w(10.0), Hw(10.0)
-  {
-    min_space = double(graph_branch_sep);
-    min_x = -0.5 * double(image_size_x) + min_space;
-    max_x = 0.5 * double(image_size_x) - min_space;
-  }
-
-  void Preprocess()
-  {
-    // initialize w[], t[], p[], l[] beforehand
-
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      if (l[i] >= 0)
-        r[l[i]] = i;
-      if (r[i] >= 0)
-        l[r[i]] = i;
-      if (p[i] >= 0)
-        C[p[i]].insert(i);
-    }
-
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      if (!C[i].empty())
-      {
-        int j = *(C[i].begin());
-        while ((l[j] >= 0) && (C[i].find(l[j]) != C[i].end()))
-          j = l[j];
-        
-        double cur_b = -0.5*w[i];
-        while ((j >= 0) && (C[i].find(j) != C[i].end()))
-        {
-          b[j] = cur_b + 0.5*w[j];
-          cur_b += w[j];
-          j = r[j];
-        }
-      }
-    }
-  }
-
-  void computeB(const vector<double> &x)
-  {
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      if (p[i] >= 0)
-        B[i] = w[i] * sqr(x[i] - (x[p[i]] + b[i]));
-      else
-        B[i] = 0.0;
-    }
-  }
-
-  void computeA(const vector<double> &x)
-  {
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      if (!C[i].empty())
-      {
-        A[i] = 0.0;
-        for (set<int>::const_iterator iter = C[i].begin(); 
-             iter != C[i].end(); ++iter)
-        {
-          int j = *iter;
-          A[i] += w[j] * (x[j] - b[j]);
-        }
-        A[i] = A[i] / w[i];
-      }
-    }
-  }
-
-  void computeL(const vector<double> &x)
-  {
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      if ((p[i] >= 0) && !C[i].empty())
-        L[i] = w[i] * sqr(x[i] - 0.5 * (x[p[i]] + A[i]));
-      else
-        L[i] = 0.0;
-    }
-  }
-
-  void computeG(const vector<double> &x)
-  {
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      if (l[i] >= 0)
-      {
-        G1[i] = x[i] - x[l[i]] - 0.5*(w[i] + w[l[i]]) - min_space;
-        G2[i] = x[i] - x[l[i]] - 0.5*max(w[i] + w[l[i]], t[i] + t[l[i]]) - min_space;
-      }
-      else
-      {
-        G1[i] = 0.0;
-        G2[i] = 0.0;
-      }
-    }
-  }
-
-  void computeH(const vector<double> &x)
-  {
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      double tw = max(w[i], t[i]);
-      double mi = min_x + 0.5 * tw;
-      double ma = max_x - 0.5 * tw;
-      H1[i] = x[i] - mi;
-      H2[i] = ma - x[i];
-    }
-  }
-
-  double computeF(const vector<double> &x)
-  {
-    computeB(x);
-    computeA(x);
-    computeL(x);
-    computeG(x);
-    computeH(x);
-
-    double total = 0.0;
-    for (int i = 0; i < num_nodes; ++i)
-    {
-#if 0
-      total += Bw*B[i] + Lw*L[i] + 
-        exp(-G1w*G1[i]) + exp(-G2w*G2[i]) + exp(-Hw*H1[i]) + exp(-Hw*H2[i]);
-#else
-      total += Bw*B[i] + Lw*L[i] +
-        exp(-G1w*G1[i]) + negsqr(G2w*G2[i]) + exp(-Hw*H1[i]) + exp(-Hw*H2[i]);
-#endif
-    }
-
-    return total;
-  }
-
-  void gradientF(const vector<double> &x, vector<double> &dx)
-  {
-    dx.resize(x.size());
-    computeA(x);
-    computeG(x);
-    computeH(x);
-    
-    for (int k = 0; k < num_nodes; ++k)
-    {
-      double dB = 0.0;
-      for (int i = 0; i < num_nodes; ++i)
-      {
-        if (p[i] >= 0)
-        {
-          if (k == i)
-            dB += 2.0 * w[i] * (x[i] - (x[p[i]] + b[i]));
-          else if (k == p[i])
-            dB -= 2.0 * w[i] * (x[i] - (x[p[i]] + b[i]));
-        }
-      }
-
-      double dL = 0.0;
-      for (int i = 0; i < num_nodes; ++i)
-      {
-        if ((p[i] >= 0) && !C[i].empty())
-        {
-          if (k == i)
-            dL += 2.0 * w[i] * (x[i] - 0.5*(x[p[i]] + A[i]));
-          else if (k == p[i])
-            dL -= w[i] * (x[i] - 0.5*(x[p[i]] + A[i]));
-          else if (C[i].find(k) != C[i].end())
-            dL -= w[k] * (x[i] - 0.5*(x[p[i]] + A[i]));
-        }
-      }
-
-      double dG = 0.0;
-      dG -= exp(-G1w*G1[k]) * G1w;
-#if 0
-      dG -= exp(-G2w*G2[k]) * G2w;
-#else
-      dG += dnegsqr(G2w*G2[k]) * G2w;
-#endif
-      if (r[k] >= 0)
-      {
-        dG += exp(-G1w*G1[r[k]]) * G1w;
-#if 0
-        dG += exp(-G2w*G2[r[k]]) * G2w;
-#else
-        dG -= dnegsqr(G2w*G2[r[k]]) * G2w;
-#endif
-      }
-
-      double dH = 0.0;
-      if (H1[k] >= -10.0)
-        dH -= exp(-Hw*H1[k]) * Hw;
-      else
-        dH -= exp(-Hw*(-10.0)) * Hw;
-      if (H2[k] >= -10.0)
-        dH += exp(-Hw*H2[k]) * Hw;
-      else
-        dH += exp(-Hw*(-10.0)) * Hw;
+/* ~~ = backspace
+   ~b0 = weight normal
+   ~b1 = weight bold
+   ~i0 = slant normal
+   ~i1 = slant italic
+   ~i2 = slant oblique
+   ~s0 = full script
+   ~s1 = super script
+   ~s2 = sub script
+   ~0 = normal everything
+*/
+  return CompileRenderText(cairo, font_face, font_size, text).Width();
+}
 
-      dx[k] = Bw*dB + Lw*dL + dG + dH;
-    }
-  }
+double GraphJob::RenderTextHeight(cairo_t *cairo, const string &font_face, 
+                                 double font_size)
+{
+/* ~~ = backspace
+   ~b0 = weight normal
+   ~b1 = weight bold
+   ~i0 = slant normal
+   ~i1 = slant italic
+   ~i2 = slant oblique
+   ~s0 = full script
+   ~s1 = super script
+   ~s2 = sub script
+   ~0 = normal everything
+*/
+  FontMetrics font_metrics = GetFontMetrics(font_face, font_size);
+  return font_metrics.ascent - font_metrics.descent;
+}
 
-  double FollowGradient(vector<double> &x, double step)
-  {
-    vector<double> gx(x.size());
-    gradientF(x, gx);
-#if 0
-    cerr << "gradient: ";
-    for (int i = 0; i < gx.size(); ++i)
-      cerr << gx[i] << " ";
-    cerr << endl;
+#if 1
+double view_size_x = 1000;
+double view_size_y = (1800.0/2700.0) * view_size_x;
+#else
+double view_size_x = 2078;
+double view_size_y = (1800.0/2700.0) * view_size_x;
 #endif
 
-    double mag = 0.0;
-    for (int i = 0; i < num_nodes; ++i)
-      mag += sqr(gx[i]);
-    mag = sqrt(mag);
-    Assert(mag > 0.0);
 
-    double scale = step / mag;
-
-    //cerr << StrFitLeft("x", 16, ' ') << StrFitLeft("gx", 16, ' ') << StrFitLeft("dx", 16, ' ') << endl;
-    for (int i = 0; i < num_nodes; ++i)
-    {
-      x[i] += gx[i] * scale;
-      //cerr << StrFitLeft(x[i], 16, ' ') << StrFitLeft(gx[i], 16, ' ') << StrFitLeft(gx[i] * scale, 16, ' ') << endl;
-    }
 
-    return mag;
-  }
-};
 
 
 double color_r(uint32 color)
@@ -843,17 +1455,6 @@ double interpolate(double x0, double x1, double s)
 #define color_interpolate_rgb(color0, color1, s) interpolate(color_r(color0), color_r(color1), s), interpolate(color_g(color0), color_g(color1), s), interpolate(color_b(color0), color_b(color1), s)
 
 
-vector<double> level_text_widths;
-vector<double> level_x;
-vector< vector<int> > node_index;
-vector<int> level_nodes;
-vector< vector<double> > node_y, node_height, node_width;
-vector< vector<double> > node_y_top;
-vector< vector<double> > node_y_offset;
-vector< vector<double> > node_slope;
-vector<uint32> level_color;
-
-
 /* old drawing code
 #if 0
         cairo_move_to(cairo, level_x[level - 1], node_y_top[level - 1][parent] + node_y_offset[level][i]);
@@ -882,92 +1483,190 @@ uint32 WHICH_BOTTOM = 8;
 uint32 WHICH_BORDER = 16;
 uint32 WHICH_ALL = WHICH_LEFT | WHICH_TOP | WHICH_RIGHT | WHICH_BOTTOM;
 
-void DrawLeftEdge(cairo_t *cairo, int level, int i, uint32 which = WHICH_ALL)
+// One piece of a band outline.  Outlines are built once as a list of
+// these and then emitted for each of the fill and the strokes, drawing
+// the edges selected by a WHICH_ mask and moving past the others.
+struct OutlineSegment
 {
-  cairo_move_to(cairo, level_x[level], node_y_top[level][i] + node_height[level][i]);
-  if (which & WHICH_LEFT)
-    cairo_rel_line_to(cairo, 0.0, -node_height[level][i]);
-  else
-    cairo_rel_move_to(cairo, 0.0, -node_height[level][i]);
+  uint32 edge;           // WHICH_ edge it belongs to, 0 to always move
+  bool relative;         // (x, y) is relative to the current point
+  bool curve;
+  bool cut;              // not drawn for WHICH_BORDER
+  double x1, y1, x2, y2; // control points of a curve
+  double x, y;
+
+  OutlineSegment(uint32 edge_, bool relative_, double x_, double y_)
+    : edge(edge_), relative(relative_), curve(false), cut(false), x(x_), y(y_)
+  {
+  }
+
+  OutlineSegment(uint32 edge_, double x1_, double y1_, double x2_, double y2_,
+                 double x_, double y_)
+    : edge(edge_), relative(false), curve(true), cut(false),
+      x1(x1_), y1(y1_), x2(x2_), y2(y2_), x(x_), y(y_)
+  {
+  }
+};
+
+void EmitOutline(cairo_t *cairo, const OutlinePath &path, uint32 which = WHICH_ALL)
+{
+  for (int s = 0; s < path.size(); ++s)
+  {
+    const OutlineSegment &segment = path[s];
+    bool draw = (segment.edge & which) && !(segment.cut && (which & WHICH_BORDER));
+    if (!draw)
+    {
+      if (segment.relative)
+        cairo_rel_move_to(cairo, segment.x, segment.y);
+      else
+        cairo_move_to(cairo, segment.x, segment.y);
+    }
+    else if (segment.relative)
+      cairo_rel_line_to(cairo, segment.x, segment.y);
+    else if (segment.curve)
+      cairo_curve_to(cairo, segment.x1, segment.y1, segment.x2, segment.y2, segment.x, segment.y);
+    else
+      cairo_line_to(cairo, segment.x, segment.y);
+  }
 }
 
-void DrawLeftEdge(cairo_t *cairo, int level, int i, int child, uint32 which = WHICH_ALL)
+// edge: the WHICH_ mask the edge is drawn for
+void GraphJob::DrawLeftEdge(OutlinePath &path, int level, int i, uint32 edge)
+{
+  path.push_back(OutlineSegment(0, false, level_x[level], node_y_top[level][i] + node_height[level][i]));
+  path.push_back(OutlineSegment(edge, true, 0.0, -node_height[level][i]));
+}
+
+void GraphJob::DrawLeftEdge(OutlinePath &path, int level, int i, int child)
 {
   int first_child = nodes[level][i].first_child;
-  cairo_move_to(cairo, level_x[level], node_y_top[level][i] + node_y_offset[level + 1][first_child + child] + node_height[level + 1][first_child + child]);
-  if (which & WHICH_LEFT)
-    cairo_rel_line_to(cairo, 0.0, -node_height[level + 1][first_child + child]);
-  else
-    cairo_rel_move_to(cairo, 0.0, -node_height[level + 1][first_child + child]);
+  path.push_back(OutlineSegment(0, false, level_x[level], node_y_top[level][i] + node_y_offset[level + 1][first_child + child] + node_height[level + 1][first_child + child]));
+  path.push_back(OutlineSegment(WHICH_LEFT, true, 0.0, -node_height[level + 1][first_child + child]));
 }
 
-void DrawRightEdge(cairo_t *cairo, int level, int i, uint32 which = WHICH_ALL)
+void GraphJob::DrawRightEdge(OutlinePath &path, int level, int i)
 {
-  if (which & WHICH_RIGHT)
-    cairo_rel_line_to(cairo, 0.0, node_height[level][i]);
-  else
-    cairo_rel_move_to(cairo, 0.0, node_height[level][i]);
+  path.push_back(OutlineSegment(WHICH_RIGHT, true, 0.0, node_height[level][i]));
 }
 
-void DrawCutRightEdge(cairo_t *cairo, int level, int i, int child, uint32 which = WHICH_ALL)
+void GraphJob::DrawCutRightEdge(OutlinePath &path, int level, int i, int child)
 {
   int first_child = nodes[level][i].first_child;
-  if ((which & WHICH_RIGHT) && !(which & WHICH_BORDER))
-    cairo_line_to(cairo, level_x[level], node_y_top[level][i] + node_y_offset[level + 1][first_child + child] + node_height[level + 1][first_child + child]);
-  else
-    cairo_move_to(cairo, level_x[level], node_y_top[level][i] + node_y_offset[level + 1][first_child + child] + node_height[level + 1][first_child + child]);
+  path.push_back(OutlineSegment(WHICH_RIGHT, false, level_x[level], node_y_top[level][i] + node_y_offset[level + 1][first_child + child] + node_height[level + 1][first_child + child]));
+  path.back().cut = true;
 }
 
-void DrawLastRightEdge(cairo_t *cairo, int level, int i, uint32 which = WHICH_ALL)
+void GraphJob::DrawLastRightEdge(OutlinePath &path, int level, int i)
 {
-  if ((which & WHICH_RIGHT) && !(which & WHICH_BORDER))
-    cairo_line_to(cairo, level_x[level], node_y_top[level][i] + node_height[level][i]);
-  else
-    cairo_move_to(cairo, level_x[level], node_y_top[level][i] + node_height[level][i]);
+  path.push_back(OutlineSegment(WHICH_RIGHT, false, level_x[level], node_y_top[level][i] + node_height[level][i]));
+  path.back().cut = true;
 }
 
-void DrawTopEdge(cairo_t *cairo, int level, int i, uint32 which = WHICH_ALL)
+void GraphJob::DrawTopEdge(OutlinePath &path, int level, int i)
 {
   int parent = nodes[level][i].parent;
-  if (which & WHICH_TOP)
-    cairo_curve_to(cairo, level_x[level - 1] + 25.0, node_y_top[level - 1][parent] + node_y_offset[level][i] + 25.0 * node_slope[level - 1][parent], level_x[level] - 25.0, node_y_top[level][i] - 25.0 * node_slope[level][i], level_x[level], node_y_top[level][i]);
-  else
-    cairo_move_to(cairo, level_x[level], node_y_top[level][i]);
+  path.push_back(OutlineSegment(WHICH_TOP, level_x[level - 1] + 25.0, node_y_top[level - 1][parent] + node_y_offset[level][i] + 25.0 * node_slope[level - 1][parent], level_x[level] - 25.0, node_y_top[level][i] - 25.0 * node_slope[level][i], level_x[level], node_y_top[level][i]));
 }
 
-void DrawBottomEdge(cairo_t *cairo, int level, int i, uint32 which = WHICH_ALL)
+void GraphJob::DrawBottomEdge(OutlinePath &path, int level, int i)
 {
   int parent = nodes[level][i].parent;
-  if (which & WHICH_BOTTOM)
-    cairo_curve_to(cairo, level_x[level] - 25.0, node_y_top[level][i] + node_height[level][i] - 25.0 * node_slope[level][i], level_x[level - 1] + 25.0, node_y_top[level - 1][parent] + node_y_offset[level][i] + node_height[level][i] + 25.0 * node_slope[level - 1][parent], level_x[level - 1], node_y_top[level - 1][parent] + node_y_offset[level][i] + node_height[level][i]);
-  else
-    cairo_move_to(cairo, level_x[level - 1], node_y_top[level - 1][parent] + node_y_offset[level][i] + node_height[level][i]);
+  path.push_back(OutlineSegment(WHICH_BOTTOM, level_x[level] - 25.0, node_y_top[level][i] + node_height[level][i] - 25.0 * node_slope[level][i], level_x[level - 1] + 25.0, node_y_top[level - 1][parent] + node_y_offset[level][i] + node_height[level][i] + 25.0 * node_slope[level - 1][parent], level_x[level - 1], node_y_top[level - 1][parent] + node_y_offset[level][i] + node_height[level][i]));
 }
 
 
-void RecurseOutline(cairo_t *cairo, int level, int i, uint32 which = WHICH_ALL)
+void GraphJob::RecurseOutline(OutlinePath &path, int level, int i)
 {
-  DrawTopEdge(cairo, level, i, which);
+  DrawTopEdge(path, level, i);
   int first_child = nodes[level][i].first_child;
   for (int child = 0; child < nodes[level][i].num_children; ++child)
     if (node_index[level + 1][first_child + child] >= 0)
-      RecurseOutline(cairo, level + 1, first_child + child, which);
+      RecurseOutline(path, level + 1, first_child + child);
     else
-      DrawCutRightEdge(cairo, level, i, child, which);
-  DrawLastRightEdge(cairo, level, i, which);
-  DrawBottomEdge(cairo, level, i, which);
+      DrawCutRightEdge(path, level, i, child);
+  DrawLastRightEdge(path, level, i);
+  DrawBottomEdge(path, level, i);
 }
 
-void TopOutline(cairo_t *cairo, uint32 which = WHICH_ALL)
+void GraphJob::TopOutline(OutlinePath &path)
 {
-  DrawLeftEdge(cairo, 0, 0, which);
+  DrawLeftEdge(path, 0, 0, WHICH_LEFT);
   int first_child = nodes[0][0].first_child;
   for (int child = 0; child < nodes[0][0].num_children; ++child)
     if (node_index[1][first_child + child] >= 0)
-      RecurseOutline(cairo, 1, first_child + child, which);
+      RecurseOutline(path, 1, first_child + child);
     else
-      DrawCutRightEdge(cairo, 0, 0, child, which);
-  DrawLastRightEdge(cairo, 0, 0, which);
+      DrawCutRightEdge(path, 0, 0, child);
+  DrawLastRightEdge(path, 0, 0);
+}
+
+enum BandKind
+{
+  BandBlank,             // unlabeled: fades to white
+  BandUnknown            // "?": darkens
+};
+
+// Gradients of blank and unknown bands, made once per (level, kind)
+class BandPatterns
+{
+public:
+  BandPatterns(const GraphJob &job_) : job(job_) { }
+
+  ~BandPatterns()
+  {
+    for (map<pair<int, int>, cairo_pattern_t *>::iterator iter = patterns.begin();
+         iter != patterns.end(); ++iter)
+      cairo_pattern_destroy(iter->second);
+  }
+
+  cairo_pattern_t *Get(int level, BandKind kind)
+  {
+    cairo_pattern_t *&pattern = patterns[make_pair(level, int(kind))];
+    if (!pattern)
+    {
+      pattern = cairo_pattern_create_linear(job.level_x[level - 1], 0.0, job.level_x[level], 0.0);
+      cairo_pattern_add_color_stop_rgba(pattern, 0.0, color_rgb(job.level_color[level - 1]), 1.0);
+      if (kind == BandBlank)
+        cairo_pattern_add_color_stop_rgba(pattern, 1.0, color_rgb(0xffffff), 1.0);
+      else
+        cairo_pattern_add_color_stop_rgba(pattern, 1.0, color_interpolate_rgb(job.level_color[level - 1], 0x000000, 0.75), 1.0);
+    }
+    return pattern;
+  }
+
+private:
+  const GraphJob &job;
+  map<pair<int, int>, cairo_pattern_t *> patterns;
+};
+
+// Layout nodes are identified by their path of labels from the root, so a
+// taxon keeps its key when other taxa are added, removed or resized
+LayoutCacheKey GraphJob::MakeLayoutCacheKey(const GraphLayout &layout)
+{
+  LayoutCacheKey key;
+  key.taxa = layout_cache_seed;
+  key.nodes.resize(layout.num_nodes, 0);
+
+  vector< vector<uint64> > path(nodes.size());
+  for (int level = 0; level < nodes.size(); ++level)
+  {
+    path[level].resize(nodes[level].size());
+    for (int i = 0; i < nodes[level].size(); ++i)
+    {
+      const DGNode &node = nodes[level][i];
+      key.taxa = LayoutCacheHash(key.taxa, uint64(level));
+      key.taxa = LayoutCacheHash(key.taxa, uint64(int64(node.parent)));
+      key.taxa = LayoutCacheHash(key.taxa, node.label);
+
+      uint64 parent_path = (level > 0) ? path[level - 1][node.parent] : layout_cache_seed;
+      path[level][i] = LayoutCacheHash(parent_path, node.label);
+      if (node_index[level][i] >= 0)
+        key.nodes[node_index[level][i]] = path[level][i];
+    }
+  }
+
+  LayoutCacheShape(layout, key);
+  return key;
 }
 
 string label_text_font = "Arial";
@@ -976,63 +1675,168 @@ string pct_label_text_font = "Arial";
 double pct_label_text_size = 7.0;
 
 
-int Main(vector<string> args)
+bool GraphJob::Render()
 {
-  cerr << "GraphPhylogeny" << endl;
-  InitBaseTables();
-  
-  params.ImportArgs(vector<string>(args.begin() + 1, args.end()));
-  InitParams();
+  vector<CairoOutput> outputs;
+  ParseOutputs(output_file, outputs);
 
-  srand(TimerSeconds());
-  if (params.Contains("rand_seed"))
-    srand(params["rand_seed"].GetInt());
+  istream *in = InFileStream(input_file);
+  if (!in)
+  {
+    cerr << "Cannot read input: " + input_file + "\n";
+    return false;
+  }
+  if (render_cache.empty())
+  {
+    bool valid = ReadNodes(*in);
+    delete in;
+    if (!valid)
+    {
+      cerr << "Invalid input: " + input_file + "\n";
+      return false;
+    }
+    Draw(outputs);
+    return true;
+  }
 
+  // the cache is keyed by the input's bytes, so it is read whole first
+  ostringstream input;
+  input << in->rdbuf();
+  delete in;
+  vector<string> images;
+  if (!DrawInput(input.str(), outputs, images))
+  {
+    cerr << "Invalid input: " + input_file + "\n";
+    return false;
+  }
+  for (int i = 0; i < outputs.size(); ++i)
+  {
+    ostream *out = OpenOutputStream(outputs[i].filename);
+    out->write(images[i].data(), images[i].size());
+    CloseOutputStream(out);
+  }
+  return true;
+}
 
-  LoadPhylogenyStructure();
+void GraphJob::DrawImages(const vector<CairoOutput> &outputs,
+                          vector<string> &images)
+{
+  images.clear();
+  if (outputs.size() > 1)
+  {
+    target.images = &images;
+    Draw(outputs);
+    target.images = NULL;
+    return;
+  }
+  ostringstream image;
+  target.output = &image;
+  Draw(outputs);
+  target.output = NULL;
+  images.push_back(image.str());
+}
 
+bool GraphJob::DrawInput(const string &input, const vector<CairoOutput> &outputs,
+                         vector<string> &images)
+{
+  vector<RenderCacheKey> keys;
+  if (!render_cache.empty())
   {
-    istream *in = InFileStream(input_file);
-    AssertMsg(in, input_file);
-    Read(*in, nodes);
-    delete in;
+    RenderCacheKey input_key = render_cache_key;
+    RenderCacheAdd(input_key, input_table ? "table" : "nodes");
+    RenderCacheAdd(input_key, input);
+    images.resize(outputs.size());
+    bool hit = true;
+    for (int i = 0; i < outputs.size(); ++i)
+    {
+      keys.push_back(input_key);
+      RenderCacheAdd(keys[i], outputs[i].format);
+      RenderCacheAdd(keys[i], ToStr(outputs[i].size_x));
+      RenderCacheAdd(keys[i], ToStr(outputs[i].size_y));
+      // several outputs are drawn through a recording, which measures text
+      // unhinted, so the same image type and size may come out differently
+      RenderCacheAdd(keys[i], (outputs.size() > 1) ? "recorded" : "direct");
+      hit = hit && LoadRenderCache(render_cache, keys[i], images[i]);
+    }
+    cerr << "Render cache " << (hit ? "hit" : "miss") << endl;
+    if (hit)
+      return true;
   }
 
+  istringstream in(input);
+  if (!ReadNodes(in))
+    return false;
+  DrawImages(outputs, images);
+  for (int i = 0; i < keys.size(); ++i)
+    SaveRenderCache(render_cache, keys[i], images[i], render_cache_bytes);
+  return true;
+}
 
+bool GraphJob::ReadNodes(istream &in)
+{
+  // a read table is turned into the levels here, as parse_data.exe would
+  // have written them to tmp.dat
+  if (input_table)
+    return ReadClassificationLevels(in, nodes, cerr);
+
+  if (!ReadLevels(in, nodes) || (nodes.size() != 8) || (nodes[0].size() != 1))
+    return false;
+  // indices out of range would be followed before ValidateLevels() could
+  // report them
+  for (int level = 0; level < nodes.size(); ++level)
+  {
+    int num_below = (level + 1 < nodes.size()) ? nodes[level + 1].size() : 0;
+    for (int i = 0; i < nodes[level].size(); ++i)
+    {
+      const DGNode &node = nodes[level][i];
+      if ((level > 0) &&
+          ((node.parent < 0) || (node.parent >= nodes[level - 1].size())))
+        return false;
+      if ((node.num_children < 0) ||
+          ((node.num_children > 0) &&
+           ((node.first_child < 0) ||
+            (node.num_children > num_below - min(node.first_child, num_below)))))
+        return false;
+    }
+  }
+  return ValidateLevels(nodes, cerr);
+}
 
-  Assert(nodes.size() == 8);
-  Assert(phylogeny_levels.size() == 8);
+void GraphJob::Draw(const vector<CairoOutput> &outputs)
+{
   int levels = 8;
 
-
-  string output_ext = GetLower(GetExtension(output_file));
+  string output_ext = outputs[0].format;
+  bool record = (outputs.size() > 1);
   cairo_t *cairo;
 
-  if (output_ext == "png")
+  if (record)
+    cairo = InitCairoRecording(target, view_size_x, view_size_y);
+  else if (outputs[0].Raster())
   {
-#if 1
-    cairo = InitCairoPNG(view_size_x, view_size_y, output_file,
-                         2079, 1386, true);
-#else
-    cairo = InitCairoPNG(view_size_x, view_size_y, output_file,
-                         2400, 1500, true);
-#endif
+    cairo = InitCairoPNG(target, view_size_x, view_size_y, outputs[0].filename,
+                         int(outputs[0].size_x), int(outputs[0].size_y), true,
+                         output_ext);
   }
   else if (output_ext == "eps")
   {
-    cairo = InitCairoEPS(view_size_x, view_size_y, output_file,
-                         (11.0 - 2.0) * 300.0, (8.5 - 2.0) * 300.0, true);
+    cairo = InitCairoEPS(target, view_size_x, view_size_y, outputs[0].filename,
+                         outputs[0].size_x, outputs[0].size_y, true);
   }
   else if (output_ext == "pdf")
   {
-    cairo = InitCairoPDF(view_size_x, view_size_y, output_file,
-                         (11.0 - 2.0) * 300.0, (8.5 - 2.0) * 300.0, true);
+    cairo = InitCairoPDF(target, view_size_x, view_size_y, outputs[0].filename,
+                         outputs[0].size_x, outputs[0].size_y, true);
   }
-  else
+  else if (output_ext == "svg")
   {
-    cerr << "Unknown output image file extension: " << output_ext << endl;
-    Exit(1);
+    cairo = InitCairoSVG(target, view_size_x, view_size_y, outputs[0].filename,
+                         outputs[0].size_x, outputs[0].size_y, true);
   }
+  else
+    Assert(false);
+
+  SetTextTarget(cairo);
 
 
   cairo_set_source_rgba(cairo, 1.0, 1.0, 1.0, 1.0);
@@ -1169,24 +1973,92 @@ int Main(vector<string> args)
     cerr << endl;
 #endif
 
+    WorkerGroup layout_workers(layout_threads);
+    if (layout_threads > 1)
+      layout.workers = &layout_workers;
+    layout.kernels = SelectLayoutKernels(layout_simd);
+    if (layout.kernels)
+      cerr << "Layout kernels: " << layout.kernels->name << endl;
+
+    LayoutTrace trace(layout_trace_every);
+    if (!layout_trace.empty())
+      layout.trace = &trace;
+
     layout.Preprocess();
+
+    // a cached solution of the same layout is used as is; a near hit is only
+    // a starting point, which the fixed descent schedule cannot make use
+    // of, so it is always refined with L-BFGS
+    LayoutCacheKey cache_key;
+    LayoutCacheStatus cache_status = LayoutCacheMiss;
+    LayoutOptimizer optimizer = layout_optimizer;
+    if (!layout_cache.empty())
+    {
+      cache_key = MakeLayoutCacheKey(layout);
+      cache_status = LoadLayoutCache(layout_cache, cache_key, layout, x);
+      cerr << "Layout cache " << LayoutCacheStatusName(cache_status) << endl;
+      if (cache_status == LayoutCacheNearHit)
+        optimizer = LayoutLBFGS;
+    }
+
     cerr << "Laying out graph..." << flush;
-    int total_iterations = 20000;
-    for (int iteration = 0; iteration < total_iterations; ++iteration)
+    if (layout_deadline > 0.0)
+      layout.SetDeadline(layout_deadline);
+    LayoutResult result;
+    if (cache_status == LayoutCacheHit)
     {
-      double step = double(total_iterations - iteration) / double(total_iterations);
-      double mag = layout.FollowGradient(x, -step);
-      x[0] = 0.0;
-      if ((iteration % 2000) == 0)
-        cerr << "." << flush;
-#if 0
-    cerr << "x: ";
-      for (int i = 0; i < x.size(); ++i)
-        cerr << x[i] << " ";
-      cerr << endl;
-#endif
+      vector<double> g;
+      layout.gradientF(x, g);
+      g[0] = 0.0;
+      double g2 = 0.0, x2 = 0.0;
+      for (int i = 0; i < g.size(); ++i)
+      {
+        g2 += g[i] * g[i];
+        x2 += x[i] * x[i];
+      }
+      result.objective = layout.computeF(x);
+      result.gradient_norm = sqrt(g2);
+      // the same test MinimizeLBFGS() stops on
+      result.converged = (result.gradient_norm <= layout_g_tolerance * max(1.0, sqrt(x2)));
     }
+    else if (optimizer == LayoutLBFGS)
+      result = layout.MinimizeLBFGS(x, layout_iterations, layout_f_tolerance,
+                                    layout_g_tolerance);
+    else if (optimizer == LayoutDirect)
+      result = layout.SolveDirect(x, layout_sweeps, layout_sweep_tolerance);
+    else if (optimizer == LayoutMultilevel)
+      result = layout.MinimizeMultilevel(x, layout_iterations,
+                                         layout_f_tolerance, layout_g_tolerance);
+    else
+      result = layout.Descend(x, layout_iterations);
     cerr << endl;
+    cerr << "Layout ("
+         << ((cache_status == LayoutCacheHit) ? "cached" : LayoutOptimizerName(optimizer))
+         << ") "
+         << (result.cut_off ? "cut off by deadline" :
+             !result.converged ? "stopped" :
+             // the direct sweeps stop moving, but not at a proven minimum
+             ((optimizer == LayoutDirect) && (cache_status != LayoutCacheHit)) ?
+               "settled" : "converged") << " after "
+         << result.iterations << " iterations, objective = "
+         << result.objective << ", gradient = " << result.gradient_norm
+         << endl;
+
+    if (layout_check_gradient)
+    {
+      int worst;
+      double error = layout.GradientError(x, worst);
+      cerr << "Gradient check: largest relative error " << error
+           << " at node " << worst << endl;
+    }
+
+    if (!layout_trace.empty())
+      trace.Write(layout_trace);
+    // a layout cut off by the deadline may be far from solved, and a later
+    // hit would use it as is
+    if (!layout_cache.empty() && (cache_status != LayoutCacheHit) &&
+        !result.cut_off)
+      SaveLayoutCache(layout_cache, cache_key, x);
 
     for (int level = 0; level < levels; ++level)
     {
@@ -1254,8 +2126,13 @@ int Main(vector<string> args)
     }
   }
 
-  DrawLeftEdge(cairo, 0, 0);
-  TopOutline(cairo, WHICH_ALL);
+  // the outline of all bands, used for the fill and both strokes; the
+  // root's left edge is part of both strokes
+  OutlinePath outline;
+  DrawLeftEdge(outline, 0, 0, WHICH_ALL);
+  TopOutline(outline);
+
+  EmitOutline(cairo, outline, WHICH_ALL);
   cairo_pattern_t *pattern = cairo_pattern_create_linear(level_x[0], 0.0, level_x[levels - 1], 0.0);
   for (int level = 0; level < levels; ++level)
     cairo_pattern_add_color_stop_rgba(pattern, (level_x[level] - level_x[0]) / (level_x[levels - 1] - level_x[0]), color_rgb(level_color[level]), 1.0);
@@ -1263,44 +2140,47 @@ int Main(vector<string> args)
   cairo_fill(cairo);
   cairo_pattern_destroy(pattern);
 
+  // Blank and "?" bands fade out to white or darken, with the same
+  // gradient for every band of a kind at a level.  The bands of a level
+  // do not overlap, so each (level, kind) is one compound path filled
+  // once with its pattern.
+  BandPatterns band_patterns(*this);
   for (int level = 1; level < levels; ++level)
   {
-    for (int i = 0; i < nodes[level].size(); ++i)
-      if (node_index[level][i] >= 0)
-        if (nodes[level][i].label.empty() || (nodes[level][i].label == "?"))
+    for (int kind = BandBlank; kind <= BandUnknown; ++kind)
+    {
+      OutlinePath bands;
+      for (int i = 0; i < nodes[level].size(); ++i)
+        if ((node_index[level][i] >= 0) &&
+            (nodes[level][i].label == ((kind == BandBlank) ? "" : "?")))
         {
           int parent = nodes[level][i].parent;
-          DrawLeftEdge(cairo, level - 1, parent, i - nodes[level - 1][parent].first_child);
-          DrawTopEdge(cairo, level, i);
-          DrawRightEdge(cairo, level, i);
-          DrawBottomEdge(cairo, level, i);
-
-          cairo_pattern_t *pattern = cairo_pattern_create_linear(level_x[level - 1], 0.0, level_x[level], 0.0);
-          cairo_pattern_add_color_stop_rgba(pattern, 0.0, color_rgb(level_color[level - 1]), 1.0);
-          if (nodes[level][i].label.empty())
-            cairo_pattern_add_color_stop_rgba(pattern, 1.0, color_rgb(0xffffff), 1.0);
-          else
-            cairo_pattern_add_color_stop_rgba(pattern, 1.0, color_interpolate_rgb(level_color[level - 1], 0x000000, 0.75), 1.0);
-          cairo_set_source(cairo, pattern);
-          cairo_fill(cairo);
-          cairo_pattern_destroy(pattern);
+          DrawLeftEdge(bands, level - 1, parent, i - nodes[level - 1][parent].first_child);
+          DrawTopEdge(bands, level, i);
+          DrawRightEdge(bands, level, i);
+          DrawBottomEdge(bands, level, i);
         }
+      if (bands.empty())
+        continue;
+
+      EmitOutline(cairo, bands);
+      cairo_set_source(cairo, band_patterns.Get(level, BandKind(kind)));
+      cairo_fill(cairo);
+    }
   }
 
   cairo_new_path(cairo);
   cairo_set_source_rgba(cairo, color_rgb(0x000000), 0.25);
   cairo_set_line_width(cairo, 2.0);
   cairo_set_line_cap(cairo, CAIRO_LINE_CAP_BUTT);
-  DrawLeftEdge(cairo, 0, 0);
-  TopOutline(cairo, WHICH_BOTTOM | WHICH_RIGHT);
+  EmitOutline(cairo, outline, WHICH_BOTTOM | WHICH_RIGHT);
   cairo_stroke(cairo);
 
   cairo_new_path(cairo);
   cairo_set_source_rgba(cairo, color_rgb(0xffffff), 0.5);
   cairo_set_line_width(cairo, 2.0);
   cairo_set_line_cap(cairo, CAIRO_LINE_CAP_ROUND);
-  DrawLeftEdge(cairo, 0, 0);
-  TopOutline(cairo, WHICH_TOP | WHICH_LEFT);
+  EmitOutline(cairo, outline, WHICH_TOP | WHICH_LEFT);
   cairo_stroke(cairo);
         
   double text_height = RenderTextHeight(cairo, label_text_font, label_text_size);
@@ -1313,7 +2193,8 @@ int Main(vector<string> args)
         string label = nodes[level][i].label;
         if (label == "-")
           label = "";
-        double width = RenderTextWidth(cairo, label_text_font, label_text_size, ((level >= 6) ? "~i1" : "~i0") + label);
+        const CompiledText &label_text = CompileRenderText(cairo, label_text_font, label_text_size, label, (level >= 6) ? "~i1" : "~i0");
+        double width = label_text.Width();
         double height = node_height[level][i];
         //height = text_height;
         double x = level_x[level];
@@ -1341,26 +2222,13 @@ int Main(vector<string> args)
           cairo_fill(cairo);
 #endif
           
-          cairo_set_source_rgba(cairo, color_rgb(0xffffff), 0.4);
-          cairo_move_to(cairo, level_x[level] + 0.5, node_y[level][i] + 0.5);
-          RenderText(cairo, label_text_font, label_text_size, 0, 0, ((level >= 6) ? "~i1" : "~i0") + label);
-          cairo_set_source_rgba(cairo, color_rgb(0xffffff), 0.4);
-          cairo_move_to(cairo, level_x[level] + 0.5, node_y[level][i] - 0.5);
-          RenderText(cairo, label_text_font, label_text_size, 0, 0, ((level >= 6) ? "~i1" : "~i0") + label);
-          cairo_set_source_rgba(cairo, color_rgb(0xffffff), 0.4);
-          cairo_move_to(cairo, level_x[level] - 0.5, node_y[level][i] + 0.5);
-          RenderText(cairo, label_text_font, label_text_size, 0, 0, ((level >= 6) ? "~i1" : "~i0") + label);
-          cairo_set_source_rgba(cairo, color_rgb(0xffffff), 0.4);
-          cairo_move_to(cairo, level_x[level] - 0.5, node_y[level][i] - 0.5);
-          RenderText(cairo, label_text_font, label_text_size, 0, 0, ((level >= 6) ? "~i1" : "~i0") + label);
-          cairo_set_source_rgba(cairo, color_rgb(0x000000), 1.0);
-          cairo_move_to(cairo, level_x[level], node_y[level][i]);
-          RenderText(cairo, label_text_font, label_text_size, 0, 0, ((level >= 6) ? "~i1" : "~i0") + label);
+          RenderHaloText(cairo, label_text, level_x[level], node_y[level][i], label_halo);
         }
 
         string pct_label = FloatToStr(100.0 * nodes[level][i].count / total_count, 2) + "%";
         if (level > 0)
         {
+          const CompiledText &pct_label_text = CompileRenderText(cairo, pct_label_text_font, pct_label_text_size, pct_label);
           int x_align = (nodes[level][i].label.empty() || (nodes[level][i].label == "?") || ((nodes[level][i].label == "-") && (level == (levels - 1)))) ? 1 : 0;
           double x_offset = (x_align > 0) ? 2.0 : 0.0;
           double y_offset = ((label == "") || (label == "?")) ? 0.0 : (label_text_size + pct_label_text_size) * 0.4375;
@@ -1368,23 +2236,320 @@ int Main(vector<string> args)
             y_offset += x_offset * node_slope[level][i];
           cairo_set_source_rgba(cairo, color_rgb(0xc0c0ff), 0.5);
           cairo_move_to(cairo, level_x[level] + x_offset + 0.5, node_y[level][i] + y_offset + 0.5);
-          RenderText(cairo, pct_label_text_font, pct_label_text_size, x_align, 0, pct_label);
+          RenderText(cairo, pct_label_text, x_align, 0);
           cairo_set_source_rgba(cairo, color_rgb(0x202060), 1.0);
           cairo_move_to(cairo, level_x[level] + x_offset, node_y[level][i] + y_offset);
-          RenderText(cairo, pct_label_text_font, pct_label_text_size, x_align, 0, pct_label);
+          RenderText(cairo, pct_label_text, x_align, 0);
         }
       }
     }
   }
 
-  if (output_ext == "png")
-    FinalizeCairoPNG(cairo);
+  if (record)
+    FinalizeCairoRecording(target, view_size_x, view_size_y, outputs);
+  else if (outputs[0].Raster())
+    FinalizeCairoPNG(target);
   else if (output_ext == "eps")
-    FinalizeCairoEPS(cairo);
+    FinalizeCairoEPS(target);
   else if (output_ext == "pdf")
-    FinalizeCairoPDF(cairo);
+    FinalizeCairoPDF(target);
+  else if (output_ext == "svg")
+    FinalizeCairoSVG(target);
   else
     Assert(false);
+}
+
+
+// Parameters that do not change the images, or that are added to the key
+// per graph (input_format, output)
+string render_cache_ignored[] =
+{
+  "input",
+  "input_format",
+  "output",
+  "render_cache",
+  "render_cache_mb",
+  "layout_trace",
+  "layout_trace_every",
+  "text_metrics_cache",
+  "batch_threads",
+  "serve_socket",
+  "serve_threads",
+  "serve_queue",
+  "serve_timeout",
+  "serve_max_size",
+  "serve_max_pixels",
+  "max_mem_mb",
+};
+int num_render_cache_ignored =
+  sizeof(render_cache_ignored) / sizeof(render_cache_ignored[0]);
+
+// The part of every render cache key that is the same for the whole run:
+// this build of the program, the phylogeny structure and the parameters
+void InitRenderCacheKey()
+{
+  RenderCacheAdd(render_cache_key, __DATE__ " " __TIME__);
+
+  istream *in = InFileStream(phylogeny_structure_file);
+  AssertMsg(in, phylogeny_structure_file);
+  ostringstream structure;
+  structure << in->rdbuf();
+  delete in;
+  RenderCacheAdd(render_cache_key, structure.str());
+
+  // exported in one form and order, however they were written
+  Params key_params = params;
+  for (int i = 0; i < num_render_cache_ignored; ++i)
+    key_params.Erase(render_cache_ignored[i]);
+  key_params.TouchAll();
+  vector<string> exported = key_params.Export();
+  sort(exported.begin(), exported.end());
+  for (int i = 0; i < exported.size(); ++i)
+    RenderCacheAdd(render_cache_key, exported[i]);
+}
+
+
+// input and output may each be a list of files (@list), which are rendered
+// in pairs, batch_threads at a time.  A pair whose input cannot be read,
+// is invalid or cannot be drawn is skipped; returns false if any was.
+bool RenderFiles()
+{
+  vector<string> input_files, output_files;
+  ParseFiles(input_file, input_files);
+  ParseFiles(output_file, output_files);
+  if (input_files.size() != output_files.size())
+  {
+    cerr << "Got " << input_files.size() << " input files but "
+         << output_files.size() << " outputs" << endl;
+    Exit(1);
+  }
+  int num_jobs = input_files.size();
+  bool batch = (num_jobs > 1);
+  if (batch && !layout_trace.empty())
+  {
+    cerr << "layout_trace is only written for a single input" << endl;
+    layout_trace.clear();
+  }
+
+  // one flag per job, so the workers need no lock to report
+  vector<char> failed(num_jobs, 0);
+  WorkerGroup workers(min(batch_threads, num_jobs));
+  workers.Run(num_jobs, [&](int job_index)
+  {
+    if (batch)
+      cerr << "Rendering " + input_files[job_index] + " to " +
+              output_files[job_index] + "\n";
+    GraphJob job(input_files[job_index], output_files[job_index]);
+    try
+    {
+      failed[job_index] = !job.Render();
+    }
+    catch (const exception &e)
+    {
+      cerr << "Cannot draw " + input_files[job_index] + ": " + e.what() + "\n";
+      failed[job_index] = 1;
+    }
+  });
+
+  int num_failed = count(failed.begin(), failed.end(), 1);
+  if (batch && (num_failed > 0))
+    cerr << num_failed << " of " << num_jobs << " inputs skipped" << endl;
+  return num_failed == 0;
+}
+
+// Render server (serve_socket=): render_client sends a graph and gets the
+// image back, so the process, the phylogeny structure, the text metrics and
+// each worker's fonts and compiled labels stay loaded between graphs.
+//
+// The options of a request are key=value lines:
+//   input_format  nodes or table, as the parameter
+//   output        image type with an optional @WIDTHxHEIGHT, e.g. png@800x533
+//   shutdown      1 stops the server once the queued requests are done
+// Everything else comes from the server's own parameters.
+string RenderRequest(const string &request, TextCache &text_cache,
+                     bool &shutdown)
+{
+  string options, input;
+  if (!DecodeRenderRequest(request, options, input))
+    return EncodeRenderResponse(1, "Bad request");
+
+  bool table = input_table;
+  string output = "png";
+  vector<string> lines;
+  SplitFields(options, lines, "\r\n");
+  for (int i = 0; i < lines.size(); ++i)
+  {
+    size_t equal = lines[i].find('=');
+    string key = lines[i].substr(0, equal);
+    string value = (equal == string::npos) ? "" : lines[i].substr(equal + 1);
+    if (key == "input_format")
+    {
+      string format = GetLower(value);
+      if ((format != "nodes") && (format != "table"))
+        return EncodeRenderResponse(1, "Unknown input_format: " + value);
+      table = (format == "table");
+    }
+    else if (key == "output")
+      output = value;
+    else if (key == "shutdown")
+      shutdown = (value == "1");
+    else
+      return EncodeRenderResponse(1, "Unknown option: " + key);
+  }
+  if (shutdown && input.empty())
+    return EncodeRenderResponse(0, "");
+
+  // named like a file, so the type comes from the extension
+  CairoOutput out;
+  string error;
+  if (!ParseOutput("request." + output, out, error))
+    return EncodeRenderResponse(1, error);
+  // the image is held in memory, so its size is bounded per side and in all
+  if ((out.size_x > serve_max_size) || (out.size_y > serve_max_size) ||
+      (out.size_x * out.size_y > serve_max_pixels))
+    return EncodeRenderResponse(1, "Output size too large: " + output);
+
+  GraphJob job("request", "", &text_cache);
+  job.input_table = table;
+  vector<string> images;
+  if (!job.DrawInput(input, vector<CairoOutput>(1, out), images))
+    return EncodeRenderResponse(1, "Invalid input");
+  return EncodeRenderResponse(0, images[0]);
+}
+
+// Nothing a client sends may stop the server, so anything thrown while
+// drawing its graph becomes an error response
+string ServeRenderRequest(const string &request, TextCache &text_cache,
+                          bool &shutdown)
+{
+  try
+  {
+    return RenderRequest(request, text_cache, shutdown);
+  }
+  catch (const exception &e)
+  {
+    return EncodeRenderResponse(1, string("Cannot draw graph: ") + e.what());
+  }
+  catch (...)
+  {
+    return EncodeRenderResponse(1, "Cannot draw graph");
+  }
+}
+
+// Connections are accepted here and queued for serve_threads workers; once
+// serve_queue are waiting, the rest wait in the socket's backlog
+void Serve()
+{
+  int listener = ListenRenderSocket(serve_socket, serve_queue);
+  if (listener < 0)
+    Exit(1);
+  cerr << "Serving on " << serve_socket << " with " << serve_threads
+       << " threads" << endl;
+
+  mutex lock;
+  condition_variable ready, space;
+  deque<int> connections;
+  bool quit = false;
+
+  vector<thread> workers;
+  for (int t = 0; t < serve_threads; ++t)
+    workers.push_back(thread([&]()
+    {
+      TextCache text_cache;
+      while (true)
+      {
+        int fd;
+        {
+          unique_lock<mutex> guard(lock);
+          while (connections.empty() && !quit)
+            ready.wait(guard);
+          if (connections.empty())
+            return;
+          fd = connections.front();
+          connections.pop_front();
+        }
+        space.notify_one();
+
+        string request;
+        bool shutdown = false;
+        if (ReceiveRenderMessage(fd, request))
+          SendRenderMessage(fd, ServeRenderRequest(request, text_cache, shutdown));
+        CloseRenderSocket(fd);
+        if (shutdown)
+        {
+          {
+            lock_guard<mutex> guard(lock);
+            quit = true;
+          }
+          space.notify_all();
+          ShutdownRenderSocket(listener);
+        }
+      }
+    }));
+
+  while (true)
+  {
+    int fd = AcceptRenderSocket(listener);
+    unique_lock<mutex> guard(lock);
+    if (fd < 0)
+    {
+      if (quit)
+        break;
+      cerr << "Cannot accept on " << serve_socket << ": " << strerror(errno) << endl;
+      continue;
+    }
+    // a client that stops sending or reading only holds its worker this long
+    if ((serve_timeout > 0) && !SetRenderSocketTimeout(fd, serve_timeout))
+      cerr << "Cannot set timeout on " << serve_socket << ": " << strerror(errno) << endl;
+    while ((connections.size() >= serve_queue) && !quit)
+      space.wait(guard);
+    connections.push_back(fd);
+    ready.notify_one();
+  }
+
+  ready.notify_all();
+  for (int t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  CloseRenderSocket(listener);
+  unlink(serve_socket.c_str());
+  cerr << "Server stopped" << endl;
+}
+
+
+int Main(vector<string> args)
+{
+  cerr << "GraphPhylogeny" << endl;
+  InitBaseTables();
+  
+  params.ImportArgs(vector<string>(args.begin() + 1, args.end()));
+  InitParams();
+
+  srand(TimerSeconds());
+  if (params.Contains("rand_seed"))
+    srand(params["rand_seed"].GetInt());
+
+
+  LoadPhylogenyStructure();
+  Assert(phylogeny_levels.size() == 8);
+
+  if (!text_metrics_file.empty())
+    text_metrics.Load(text_metrics_file);
+  if (!render_cache.empty())
+    InitRenderCacheKey();
+
+  bool ok = true;
+  if (!serve_socket.empty())
+  {
+    layout_trace.clear();
+    Serve();
+  }
+  else
+    ok = RenderFiles();
+
+  cerr << "Text metrics: " << text_metrics.NumHits() << " cached, "
+       << text_metrics.NumMisses() << " measured" << endl;
+  if (!text_metrics_file.empty())
+    text_metrics.Save(text_metrics_file);
 
-  return 0;
+  return ok ? 0 : 1;
 }
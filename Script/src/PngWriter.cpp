@@ -0,0 +1,271 @@
+#include "System.h"
+#include "Utility.h"
+#include "PngWriter.h"
+
+
+PngFilter ParsePngFilter(const string &name)
+{
+  string lower = GetLower(name);
+  if (lower == "none")
+    return PngFilterNone;
+  else if (lower == "sub")
+    return PngFilterSub;
+  else if (lower == "up")
+    return PngFilterUp;
+  else if (lower == "average")
+    return PngFilterAverage;
+  else if (lower == "paeth")
+    return PngFilterPaeth;
+  else if (lower == "adaptive")
+    return PngFilterAdaptive;
+
+  cerr << "Unknown png_filter: " << name << endl;
+  Exit(1);
+  return PngFilterNone;
+}
+
+// window of a deflate stream, so the most one group can refer back into
+// the group before it
+const int png_dictionary_size = 32768;
+
+bool PngOpaque(const unsigned char *data, int width, int height, int stride)
+{
+  for (int y = 0; y < height; ++y)
+  {
+    const uint32 *pixels = (const uint32 *)(data + y * stride);
+    for (int x = 0; x < width; ++x)
+      if ((pixels[x] >> 24) != 0xff)
+        return false;
+  }
+  return true;
+}
+
+// One row as PNG samples, un-premultiplying as cairo does
+void PngConvertRow(const uint32 *pixels, int width, int channels,
+                   unsigned char *row)
+{
+  for (int x = 0; x < width; ++x)
+  {
+    uint32 a = pixels[x] >> 24;
+    uint32 r = (pixels[x] >> 16) & 0xff;
+    uint32 g = (pixels[x] >> 8) & 0xff;
+    uint32 b = pixels[x] & 0xff;
+    if ((a != 0xff) && (channels == 4))
+    {
+      r = a ? (r * 255 + a / 2) / a : 0;
+      g = a ? (g * 255 + a / 2) / a : 0;
+      b = a ? (b * 255 + a / 2) / a : 0;
+    }
+    *row++ = r;
+    *row++ = g;
+    *row++ = b;
+    if (channels == 4)
+      *row++ = a;
+  }
+}
+
+inline unsigned char PngPaeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc))
+    return a;
+  return (pb <= pc) ? b : c;
+}
+
+// Filters row (prev is the row above, all zeros for the first) into out,
+// which gets the filter type byte and then the filtered samples
+void PngFilterRow(PngFilter filter, const unsigned char *row,
+                  const unsigned char *prev, int row_bytes, int bpp,
+                  unsigned char *out)
+{
+  *out++ = filter;
+  for (int i = 0; i < row_bytes; ++i)
+  {
+    int left = (i >= bpp) ? row[i - bpp] : 0;
+    int up = prev[i];
+    int up_left = (i >= bpp) ? prev[i - bpp] : 0;
+    switch (filter)
+    {
+    case PngFilterNone:
+      out[i] = row[i];
+      break;
+    case PngFilterSub:
+      out[i] = row[i] - left;
+      break;
+    case PngFilterUp:
+      out[i] = row[i] - up;
+      break;
+    case PngFilterAverage:
+      out[i] = row[i] - ((left + up) >> 1);
+      break;
+    case PngFilterPaeth:
+      out[i] = row[i] - PngPaeth(left, up, up_left);
+      break;
+    default:
+      Assert(false);
+    }
+  }
+}
+
+// The usual heuristic: the filter whose output, read as signed bytes, has
+// the smallest sum of magnitudes
+void PngFilterRowAdaptive(const unsigned char *row, const unsigned char *prev,
+                          int row_bytes, int bpp, unsigned char *out,
+                          vector<unsigned char> &scratch)
+{
+  scratch.resize(row_bytes + 1);
+  uint64 best_sum = 0;
+  for (int filter = PngFilterNone; filter <= PngFilterPaeth; ++filter)
+  {
+    PngFilterRow(PngFilter(filter), row, prev, row_bytes, bpp, &scratch[0]);
+    uint64 sum = 0;
+    for (int i = 1; i <= row_bytes; ++i)
+      sum += abs(int((signed char)scratch[i]));
+    if ((filter == PngFilterNone) || (sum < best_sum))
+    {
+      best_sum = sum;
+      memcpy(out, &scratch[0], row_bytes + 1);
+    }
+  }
+}
+
+// Raw deflate of one group of rows.  Groups other than the last end on a
+// byte boundary without a final block, so they can be concatenated.
+void PngDeflateGroup(const vector<unsigned char> &in,
+                     const vector<unsigned char> *dictionary, int level,
+                     bool last, vector<unsigned char> &out)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  Assert(deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  if (dictionary && !dictionary->empty())
+  {
+    int size = min(int(dictionary->size()), png_dictionary_size);
+    Assert(deflateSetDictionary(&stream, &(*dictionary)[dictionary->size() - size], size) == Z_OK);
+  }
+
+  out.resize(deflateBound(&stream, in.size()) + 16);
+  stream.next_in = (Bytef *)(in.empty() ? NULL : &in[0]);
+  stream.avail_in = in.size();
+  stream.next_out = &out[0];
+  stream.avail_out = out.size();
+  int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  int status;
+  while (true)
+  {
+    status = deflate(&stream, flush);
+    Assert((status == Z_OK) || (status == Z_STREAM_END) || (status == Z_BUF_ERROR));
+    if (last ? (status == Z_STREAM_END) : ((stream.avail_in == 0) && (stream.avail_out > 0)))
+      break;
+    size_t used = out.size() - stream.avail_out;
+    out.resize(out.size() * 2);
+    stream.next_out = &out[used];
+    stream.avail_out = out.size() - used;
+  }
+  out.resize(out.size() - stream.avail_out);
+  deflateEnd(&stream);
+}
+
+void PngWriteUint32(ostream &out, uint32 x)
+{
+  unsigned char bytes[4] = { (unsigned char)(x >> 24), (unsigned char)(x >> 16),
+                             (unsigned char)(x >> 8), (unsigned char)x };
+  out.write((const char *)bytes, 4);
+}
+
+void PngWriteChunk(ostream &out, const char *type, const unsigned char *data,
+                   uint32 length)
+{
+  PngWriteUint32(out, length);
+  out.write(type, 4);
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  if (length > 0)
+  {
+    out.write((const char *)data, length);
+    crc = crc32(crc, data, length);
+  }
+  PngWriteUint32(out, crc);
+}
+
+bool WritePNG(ostream &out, const unsigned char *data, int width, int height,
+              int stride, const PngOptions &options)
+{
+  Assert((width > 0) && (height > 0));
+  int level = max(0, min(options.level, 9));
+  int channels = PngOpaque(data, width, height, stride) ? 3 : 4;
+  int row_bytes = width * channels;
+
+  // rows are split into groups of at least 16 rows, a few per thread
+  int num_threads = max(options.threads, 1);
+  int num_groups = (num_threads > 1) ? max(min(4 * num_threads, height / 16), 1) : 1;
+  int group_rows = (height + num_groups - 1) / num_groups;
+  num_groups = (height + group_rows - 1) / group_rows;
+
+  vector< vector<unsigned char> > filtered(num_groups), deflated(num_groups);
+  vector<uLong> adlers(num_groups);
+  WorkerGroup workers(min(num_threads, num_groups));
+
+  workers.Run(num_groups, [&](int group)
+  {
+    int y0 = group * group_rows;
+    int y1 = min(y0 + group_rows, height);
+    vector<unsigned char> prev(row_bytes, 0), row(row_bytes), scratch;
+    if (y0 > 0)
+      PngConvertRow((const uint32 *)(data + (y0 - 1) * stride), width, channels, &prev[0]);
+    vector<unsigned char> &f = filtered[group];
+    f.resize((y1 - y0) * (row_bytes + 1));
+    for (int y = y0; y < y1; ++y)
+    {
+      PngConvertRow((const uint32 *)(data + y * stride), width, channels, &row[0]);
+      unsigned char *dest = &f[(y - y0) * (row_bytes + 1)];
+      if (options.filter == PngFilterAdaptive)
+        PngFilterRowAdaptive(&row[0], &prev[0], row_bytes, channels, dest, scratch);
+      else
+        PngFilterRow(options.filter, &row[0], &prev[0], row_bytes, channels, dest);
+      prev.swap(row);
+    }
+    adlers[group] = adler32(adler32(0, NULL, 0), &f[0], f.size());
+  });
+
+  // each group needs the filtered rows of the one before as its
+  // dictionary, so this waits until all are filtered
+  workers.Run(num_groups, [&](int group)
+  {
+    PngDeflateGroup(filtered[group], (group > 0) ? &filtered[group - 1] : NULL,
+                    level, group == (num_groups - 1), deflated[group]);
+  });
+
+  uLong adler = adlers[0];
+  for (int group = 1; group < num_groups; ++group)
+    adler = adler32_combine(adler, adlers[group], filtered[group].size());
+
+  static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  out.write((const char *)signature, 8);
+
+  unsigned char header[13];
+  for (int i = 0; i < 4; ++i)
+  {
+    header[i] = (uint32(width) >> (24 - 8 * i)) & 0xff;
+    header[4 + i] = (uint32(height) >> (24 - 8 * i)) & 0xff;
+  }
+  header[8] = 8;                              // bit depth
+  header[9] = (channels == 4) ? 6 : 2;        // RGBA or RGB
+  header[10] = header[11] = header[12] = 0;   // deflate, adaptive, no interlace
+  PngWriteChunk(out, "IHDR", header, 13);
+
+  // zlib header with the level hint, then the groups, then the checksum
+  unsigned char zlib_header[2];
+  zlib_header[0] = 0x78;
+  zlib_header[1] = ((level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3) << 6;
+  zlib_header[1] += 31 - ((zlib_header[0] * 256 + zlib_header[1]) % 31);
+  deflated[0].insert(deflated[0].begin(), zlib_header, zlib_header + 2);
+  for (int i = 0; i < 4; ++i)
+    deflated[num_groups - 1].push_back((adler >> (24 - 8 * i)) & 0xff);
+
+  for (int group = 0; group < num_groups; ++group)
+    PngWriteChunk(out, "IDAT", &deflated[group][0], deflated[group].size());
+  PngWriteChunk(out, "IEND", NULL, 0);
+
+  return out.good();
+}
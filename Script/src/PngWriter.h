@@ -0,0 +1,38 @@
+// PngWriter.h: PNG encoder on zlib with a choice of compression level and
+// row filter, which can deflate groups of rows on several threads
+
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include "System.h"
+
+enum PngFilter
+{
+  PngFilterNone = 0,
+  PngFilterSub,
+  PngFilterUp,
+  PngFilterAverage,
+  PngFilterPaeth,
+  PngFilterAdaptive      // per row, whichever filter looks smallest
+};
+
+PngFilter ParsePngFilter(const string &name);
+
+struct PngOptions
+{
+  int level;             // zlib compression level, 0-9
+  PngFilter filter;
+  int threads;
+
+  PngOptions() : level(6), filter(PngFilterAdaptive), threads(1) { }
+};
+
+// Writes pixels in cairo's ARGB32 layout (native endian 32 bit words,
+// premultiplied alpha) as an 8 bit RGBA PNG, or RGB if every pixel is
+// opaque.  With more than one thread, groups of rows are deflated in
+// parallel, each primed with the end of the group before it, and joined
+// into one zlib stream.
+bool WritePNG(ostream &out, const unsigned char *data, int width, int height,
+              int stride, const PngOptions &options);
+
+#endif
@@ -0,0 +1,123 @@
+#include "System.h"
+#include "Utility.h"
+#include "GraphLayoutCache.h"
+#include "RenderCache.h"
+#include <utime.h>
+
+
+const uint32 render_cache_version = 1;
+const string render_cache_ext = ".image";
+
+RenderCacheKey::RenderCacheKey()
+  : fnv(layout_cache_seed), crc(crc32(0, NULL, 0))
+{
+}
+
+void RenderCacheAdd(RenderCacheKey &key, const string &s)
+{
+  key.fnv = LayoutCacheHash(LayoutCacheHash(key.fnv, uint64(s.length())), s);
+  uint64 length = s.length();
+  key.crc = crc32(key.crc, (const Bytef *)&length, sizeof(length));
+  key.crc = crc32(key.crc, (const Bytef *)s.data(), s.length());
+}
+
+string RenderCacheFile(const string &dir, const RenderCacheKey &key)
+{
+  ostringstream name;
+  name << hex << setfill('0') << setw(16) << key.fnv << setw(8) << key.crc
+       << render_cache_ext;
+  return RelPath(dir, name.str());
+}
+
+bool LoadRenderCache(const string &dir, const RenderCacheKey &key,
+                     string &image)
+{
+  string filename = RenderCacheFile(dir, key);
+  ifstream in(filename.c_str(), ios::binary);
+  if (!in.is_open())
+    return false;
+  uint32 version = 0, crc = 0;
+  uint64 fnv = 0, size = 0;
+  Read(in, version);
+  Read(in, fnv);
+  Read(in, crc);
+  Read(in, size);
+  if (!in || (version != render_cache_version) || (fnv != key.fnv) ||
+      (crc != key.crc) || (size > GetFileSize(filename)))
+    return false;
+  image.resize(size);
+  if (size > 0)
+    in.read(&image[0], size);
+  if (!in)
+    return false;
+
+  // eviction goes by modification time
+  utime(filename.c_str(), NULL);
+  return true;
+}
+
+struct RenderCacheEntry
+{
+  string filename;
+  int64 size;
+  time_t used;
+
+  bool operator<(const RenderCacheEntry &x) const { return used < x.used; }
+};
+
+// Modification times only go to the second, so keep, the image just saved,
+// is left out and never evicted
+void EvictRenderCache(const string &dir, const string &keep, int64 max_bytes)
+{
+  vector<string> files, subdirs;
+  if (!GetDirectoryList(dir, files, subdirs))
+    return;
+  vector<RenderCacheEntry> entries;
+  int64 total = 0;
+  for (int i = 0; i < files.size(); ++i)
+  {
+    if ((files[i].length() <= render_cache_ext.length()) ||
+        (files[i].compare(files[i].length() - render_cache_ext.length(),
+                          string::npos, render_cache_ext) != 0))
+      continue;
+    RenderCacheEntry entry;
+    entry.filename = RelPath(dir, files[i]);
+    struct stat info;
+    if (stat(entry.filename.c_str(), &info) != 0)
+      continue;
+    entry.size = info.st_size;
+    entry.used = info.st_mtime;
+    total += entry.size;
+    if (entry.filename != keep)
+      entries.push_back(entry);
+  }
+
+  sort(entries.begin(), entries.end());
+  for (int i = 0; (i < entries.size()) && (total > max_bytes); ++i)
+  {
+    // another process may have removed it already
+    RemoveFile(entries[i].filename);
+    total -= entries[i].size;
+  }
+}
+
+void SaveRenderCache(const string &dir, const RenderCacheKey &key,
+                     const string &image, int64 max_bytes)
+{
+  MakeDir(dir);
+  string filename = RenderCacheFile(dir, key);
+  if (!WriteFileAtomic(filename, [&](ostream &out)
+  {
+    Write(out, render_cache_version);
+    Write(out, key.fnv);
+    Write(out, key.crc);
+    Write(out, uint64(image.size()));
+    out.write(image.data(), image.size());
+  }))
+  {
+    cerr << "Cannot write render cache " << filename << endl;
+    return;
+  }
+
+  EvictRenderCache(dir, filename, max_bytes);
+}
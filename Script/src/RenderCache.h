@@ -0,0 +1,31 @@
+// RenderCache.h: Keeps finished images on disk, keyed by everything that
+// goes into them, so a graph drawn before is copied instead of drawn again
+
+#ifndef RENDERCACHE_H
+#define RENDERCACHE_H
+
+#include "System.h"
+
+// Two hashes of the same bytes, FNV-1a and CRC-32, for a 96 bit key
+struct RenderCacheKey
+{
+  uint64 fnv;
+  uint32 crc;
+
+  RenderCacheKey();
+};
+
+// Adds s to the key, with its length, so "ab","c" and "a","bc" differ
+void RenderCacheAdd(RenderCacheKey &key, const string &s);
+
+// Fills in image with the one saved for key in dir and marks it as recently
+// used.  Returns false on a miss.
+bool LoadRenderCache(const string &dir, const RenderCacheKey &key,
+                     string &image);
+
+// Saves image for key, then removes the least recently used images until
+// the ones in dir add up to at most max_bytes
+void SaveRenderCache(const string &dir, const RenderCacheKey &key,
+                     const string &image, int64 max_bytes);
+
+#endif
@@ -0,0 +1,101 @@
+// RenderClient.cpp: render_client.exe, which sends one graph to a
+// phylo_graph render server (serve_socket=) and writes the image it returns
+
+#include "System.h"
+#include "Utility.h"
+#include "Params.h"
+#include "RenderSocket.h"
+
+Params params;
+
+int Main(vector<string> args)
+{
+  params.ImportArgs(vector<string>(args.begin() + 1, args.end()));
+  params.ExpandImports();
+  params.Require("serve_socket");
+  string socket_path = params["serve_socket"].GetString();
+  bool shutdown = params.Contains("serve_shutdown") &&
+    (params["serve_shutdown"].GetInt() != 0);
+  if (!shutdown)
+  {
+    params.Require("input");
+    params.Require("output");
+  }
+
+  string options, input;
+  if (params.Contains("input"))
+  {
+    string input_file = params["input"].GetString();
+    istream *in = InFileStream(input_file);
+    AssertMsg(in, input_file);
+    ostringstream bytes;
+    bytes << in->rdbuf();
+    input = bytes.str();
+    delete in;
+    if (params.Contains("input_format"))
+      options += "input_format=" + params["input_format"].GetString() + "\n";
+  }
+
+  // the server renders the type named by the extension, at the size after
+  // an @ if there is one; "-" writes output_format to stdout
+  string output_file;
+  if (params.Contains("output"))
+  {
+    output_file = params["output"].GetString();
+    string size;
+    size_t at = output_file.rfind('@');
+    if ((at != string::npos) && (at > 0))
+    {
+      size = output_file.substr(at);
+      output_file = output_file.substr(0, at);
+    }
+    string format;
+    if (output_file == "-")
+      format = params.Contains("output_format") ?
+        GetLower(params["output_format"].GetString()) : "png";
+    else
+      format = GetLower(GetExtension(output_file));
+    options += "output=" + format + size + "\n";
+  }
+  if (shutdown)
+    options += "shutdown=1\n";
+
+  int fd = ConnectRenderSocket(socket_path);
+  if (fd < 0)
+    Exit(1);
+  string response;
+  if (!SendRenderMessage(fd, EncodeRenderRequest(options, input)) ||
+      !ReceiveRenderMessage(fd, response))
+  {
+    cerr << "No response from " << socket_path << endl;
+    Exit(1);
+  }
+  CloseRenderSocket(fd);
+
+  int status;
+  string body;
+  if (!DecodeRenderResponse(response, status, body))
+  {
+    cerr << "Bad response from " << socket_path << endl;
+    Exit(1);
+  }
+  if (status != 0)
+  {
+    cerr << body << endl;
+    Exit(1);
+  }
+
+  if (output_file == "-")
+  {
+    cout.write(body.data(), body.size());
+    cout.flush();
+  }
+  else if (!output_file.empty())
+  {
+    ostream *out = OutFileStream(output_file);
+    AssertMsg(out, output_file);
+    out->write(body.data(), body.size());
+    delete out;
+  }
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include "System.h"
+#include "Utility.h"
+#include "RenderSocket.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+bool MakeRenderSocketAddress(const string &path, sockaddr_un &address)
+{
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.length() >= sizeof(address.sun_path))
+  {
+    cerr << "Socket path too long: " << path << endl;
+    return false;
+  }
+  strcpy(address.sun_path, path.c_str());
+  return true;
+}
+
+int ListenRenderSocket(const string &path, int backlog)
+{
+  sockaddr_un address;
+  if (!MakeRenderSocketAddress(path, address))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    cerr << "Cannot create socket: " << strerror(errno) << endl;
+    return -1;
+  }
+  // a socket left behind by a server that did not shut down cleanly
+  unlink(path.c_str());
+  if ((bind(fd, (sockaddr *)&address, sizeof(address)) < 0) ||
+      (listen(fd, backlog) < 0))
+  {
+    cerr << "Cannot listen on " << path << ": " << strerror(errno) << endl;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int AcceptRenderSocket(int listener)
+{
+  for (;;)
+  {
+    int fd = accept(listener, NULL, NULL);
+    if ((fd >= 0) || (errno != EINTR))
+      return fd;
+  }
+}
+
+int ConnectRenderSocket(const string &path)
+{
+  sockaddr_un address;
+  if (!MakeRenderSocketAddress(path, address))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    cerr << "Cannot create socket: " << strerror(errno) << endl;
+    return -1;
+  }
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+  {
+    cerr << "Cannot connect to " << path << ": " << strerror(errno) << endl;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool SetRenderSocketTimeout(int fd, int seconds)
+{
+  timeval timeout;
+  timeout.tv_sec = seconds;
+  timeout.tv_usec = 0;
+  return (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0) &&
+    (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0);
+}
+
+void ShutdownRenderSocket(int listener)
+{
+  shutdown(listener, SHUT_RDWR);
+}
+
+void CloseRenderSocket(int fd)
+{
+  close(fd);
+}
+
+bool SendRenderBytes(int fd, const char *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+bool ReceiveRenderBytes(int fd, char *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t received = recv(fd, data, length, 0);
+    if (received < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (received == 0)
+      return false;
+    data += received;
+    length -= received;
+  }
+  return true;
+}
+
+bool SendRenderMessage(int fd, const string &message)
+{
+  if (message.length() > render_message_limit)
+    return false;
+  uint32 length = message.length();
+  return SendRenderBytes(fd, (const char *)&length, sizeof(length)) &&
+    SendRenderBytes(fd, message.data(), message.length());
+}
+
+bool ReceiveRenderMessage(int fd, string &message)
+{
+  uint32 length;
+  if (!ReceiveRenderBytes(fd, (char *)&length, sizeof(length)) ||
+      (length > render_message_limit))
+    return false;
+  message.resize(length);
+  return (length == 0) || ReceiveRenderBytes(fd, &message[0], length);
+}
+
+// Read<string> trusts the length it reads, which a message from a socket
+// cannot be
+bool ReadRenderString(istream &in, string &x)
+{
+  int size = -1;
+  Read(in, size);
+  if (!in || (size < 0) || (size > render_message_limit))
+    return false;
+  x.resize(size);
+  if (size > 0)
+    in.read(&x[0], size);
+  return bool(in);
+}
+
+string EncodeRenderRequest(const string &options, const string &input)
+{
+  ostringstream out;
+  Write(out, render_protocol_version);
+  Write(out, options);
+  Write(out, input);
+  return out.str();
+}
+
+bool DecodeRenderRequest(const string &message, string &options,
+                         string &input)
+{
+  istringstream in(message);
+  uint32 version = 0;
+  Read(in, version);
+  return in && (version == render_protocol_version) &&
+    ReadRenderString(in, options) && ReadRenderString(in, input);
+}
+
+string EncodeRenderResponse(int status, const string &body)
+{
+  ostringstream out;
+  Write(out, status);
+  Write(out, body);
+  return out.str();
+}
+
+bool DecodeRenderResponse(const string &message, int &status, string &body)
+{
+  istringstream in(message);
+  Read(in, status);
+  return in && ReadRenderString(in, body);
+}
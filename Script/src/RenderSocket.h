@@ -0,0 +1,36 @@
+// RenderSocket.h: Unix domain socket protocol between phylo_graph's render
+// server and render_client
+
+#ifndef RENDERSOCKET_H
+#define RENDERSOCKET_H
+
+#include "System.h"
+
+// Each message is a 32 bit length followed by that many bytes.  A request
+// holds the protocol version, the options as key=value lines and the
+// input (a read table or parse_data.exe's binary levels); the response
+// holds a status, 0 for success, and the encoded image or an error
+// message.
+const uint32 render_protocol_version = 1;
+const uint32 render_message_limit = 256 << 20;
+
+// Socket descriptors, or -1 with the reason on cerr
+int ListenRenderSocket(const string &path, int backlog);
+int AcceptRenderSocket(int listener);
+int ConnectRenderSocket(const string &path);
+// Sends and receives on fd fail after waiting seconds for the other end
+bool SetRenderSocketTimeout(int fd, int seconds);
+// Makes a blocked AcceptRenderSocket() on listener return -1
+void ShutdownRenderSocket(int listener);
+void CloseRenderSocket(int fd);
+
+bool SendRenderMessage(int fd, const string &message);
+bool ReceiveRenderMessage(int fd, string &message);
+
+string EncodeRenderRequest(const string &options, const string &input);
+bool DecodeRenderRequest(const string &message, string &options,
+                         string &input);
+string EncodeRenderResponse(int status, const string &body);
+bool DecodeRenderResponse(const string &message, int &status, string &body);
+
+#endif
@@ -786,3 +786,104 @@ int CallProgram(const string &program, const vector<string> &args,
   //cerr << " done." << endl;
   return result;
 }
+
+
+WorkerGroup::WorkerGroup(int num_threads_)
+  : num_threads(max(num_threads_, 1)), cur_job(NULL), cur_num_jobs(0),
+    next_job(0), jobs_done(0), active(0), generation(0), quit(false)
+{
+  for (int i = 1; i < num_threads; ++i)
+    workers.push_back(thread(&WorkerGroup::WorkerLoop, this));
+}
+
+WorkerGroup::~WorkerGroup()
+{
+  {
+    unique_lock<mutex> guard(lock);
+    quit = true;
+  }
+  start_cv.notify_all();
+  for (int i = 0; i < workers.size(); ++i)
+    workers[i].join();
+}
+
+int WorkerGroup::Work(const function<void(int)> &job, int num_jobs)
+{
+  int done = 0;
+  for (;;)
+  {
+    int j = next_job++;
+    if (j >= num_jobs)
+      break;
+    job(j);
+    ++done;
+  }
+  return done;
+}
+
+void WorkerGroup::WorkerLoop()
+{
+  uint64 seen = 0;
+  for (;;)
+  {
+    const function<void(int)> *job;
+    int num_jobs;
+    {
+      unique_lock<mutex> guard(lock);
+      while (!quit && (generation == seen))
+        start_cv.wait(guard);
+      if (quit)
+        return;
+      seen = generation;
+      job = cur_job;
+      num_jobs = cur_num_jobs;
+      ++active;
+    }
+
+    int done = Work(*job, num_jobs);
+
+    {
+      unique_lock<mutex> guard(lock);
+      jobs_done += done;
+      --active;
+    }
+    done_cv.notify_all();
+  }
+}
+
+void WorkerGroup::Run(int num_jobs, const function<void(int)> &job)
+{
+  if ((num_threads == 1) || (num_jobs <= 1))
+  {
+    for (int j = 0; j < num_jobs; ++j)
+      job(j);
+    return;
+  }
+
+  {
+    // a worker that woke too late for the previous job may still be
+    // checking for leftover indices
+    unique_lock<mutex> guard(lock);
+    while (active > 0)
+      done_cv.wait(guard);
+    cur_job = &job;
+    cur_num_jobs = num_jobs;
+    next_job = 0;
+    jobs_done = 0;
+    ++generation;
+  }
+  start_cv.notify_all();
+
+  int done = Work(job, num_jobs);
+
+  unique_lock<mutex> guard(lock);
+  jobs_done += done;
+  while (jobs_done < num_jobs)
+    done_cv.wait(guard);
+}
+
+int HardwareThreads()
+{
+  int n = thread::hardware_concurrency();
+  return (n > 0) ? n : 1;
+}
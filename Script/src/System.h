@@ -37,6 +37,13 @@ using namespace __gnu_cxx;
 #include <unordered_set>
 //#include <ext/hash_map>
 #include <unordered_map>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
 #include <bzlib.h>
 #include <zlib.h>
 #include <unistd.h>
@@ -380,6 +387,38 @@ int CallProgram(const string &program, const vector<string> &args,
                 const string &stderr_file);
 
 
+// WorkerGroup: a fixed set of threads that share out the indices of a job.
+// The calling thread works as well, and Run() returns once every index has
+// been processed.  Which thread runs which index is not fixed, so jobs
+// should write each index's result to its own slot.
+class WorkerGroup
+{
+public:
+  WorkerGroup(int num_threads_ = 1);
+  ~WorkerGroup();
+
+  int NumThreads() const { return num_threads; }
+  void Run(int num_jobs, const function<void(int)> &job);
+
+private:
+  int num_threads;
+  vector<thread> workers;
+  mutex lock;
+  condition_variable start_cv, done_cv;
+  const function<void(int)> *cur_job;
+  int cur_num_jobs;
+  atomic<int> next_job;
+  int jobs_done, active;
+  uint64 generation;
+  bool quit;
+
+  void WorkerLoop();
+  int Work(const function<void(int)> &job, int num_jobs);
+};
+
+int HardwareThreads();
+
+
 // Main entry point to program
 int Main(vector<string> args);
 
@@ -0,0 +1,160 @@
+#include "System.h"
+#include "Utility.h"
+#include "TextMetrics.h"
+
+
+const uint32 text_metrics_version = 1;
+
+TextMetricsCache::TextMetricsCache()
+  : hits(0), misses(0), changed(false)
+{
+}
+
+// fields are separated by NULs, which cannot appear in a label; the size
+// is stored by its bits so keys never depend on number formatting
+string TextMetricsCache::Key(const string &target, const string &face,
+                             double size, int slant, int weight,
+                             const string &text)
+{
+  string key = target;
+  key += '\0';
+  key += face;
+  key += '\0';
+  key.append((const char *)&size, sizeof(size));
+  key += char('0' + slant);
+  key += char('0' + weight);
+  key += text;
+  return key;
+}
+
+bool TextMetricsCache::FindFont(const string &target, const string &face,
+                                double size, FontMetrics &metrics) const
+{
+  string key = Key(target, face, size, 0, 0, "");
+  unique_lock<mutex> guard(lock);
+  unordered_map<string, FontMetrics>::const_iterator iter = fonts.find(key);
+  if (iter == fonts.end())
+  {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  metrics = iter->second;
+  return true;
+}
+
+void TextMetricsCache::AddFont(const string &target, const string &face,
+                               double size, const FontMetrics &metrics)
+{
+  string key = Key(target, face, size, 0, 0, "");
+  unique_lock<mutex> guard(lock);
+  fonts[key] = metrics;
+  changed = true;
+}
+
+bool TextMetricsCache::FindRun(const string &target, const string &face,
+                               double size, int slant, int weight,
+                               const string &text,
+                               TextRunMetrics &metrics) const
+{
+  string key = Key(target, face, size, slant, weight, text);
+  unique_lock<mutex> guard(lock);
+  unordered_map<string, TextRunMetrics>::const_iterator iter = runs.find(key);
+  if (iter == runs.end())
+  {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  metrics = iter->second;
+  return true;
+}
+
+void TextMetricsCache::AddRun(const string &target, const string &face,
+                              double size, int slant, int weight,
+                              const string &text,
+                              const TextRunMetrics &metrics)
+{
+  string key = Key(target, face, size, slant, weight, text);
+  unique_lock<mutex> guard(lock);
+  runs[key] = metrics;
+  changed = true;
+}
+
+bool TextMetricsCache::Load(const string &filename)
+{
+  ifstream in(filename.c_str(), ios::binary);
+  if (!in.is_open())
+    return false;
+
+  uint32 version = 0;
+  Read(in, version);
+  if (!in || (version != text_metrics_version))
+    return false;
+
+  // read into copies, so a truncated or corrupt file leaves nothing behind
+  unordered_map<string, FontMetrics> new_fonts;
+  unordered_map<string, TextRunMetrics> new_runs;
+  int num_fonts = 0, num_runs = 0;
+  Read(in, num_fonts);
+  for (int i = 0; in && (i < num_fonts); ++i)
+  {
+    string key;
+    FontMetrics metrics;
+    Read(in, key);
+    Read(in, metrics.ascent);
+    Read(in, metrics.descent);
+    new_fonts[key] = metrics;
+  }
+  Read(in, num_runs);
+  for (int i = 0; in && (i < num_runs); ++i)
+  {
+    string key;
+    TextRunMetrics metrics;
+    Read(in, key);
+    Read(in, metrics.x_bearing);
+    Read(in, metrics.width);
+    Read(in, metrics.x_advance);
+    new_runs[key] = metrics;
+  }
+  if (!in)
+    return false;
+  fonts.swap(new_fonts);
+  runs.swap(new_runs);
+  return true;
+}
+
+bool TextMetricsCache::Save(const string &filename) const
+{
+  if (!changed)
+    return true;
+
+  // concurrent renders never load a partial cache
+  if (!WriteFileAtomic(filename, [&](ostream &out)
+  {
+    Write(out, text_metrics_version);
+    int num_fonts = fonts.size(), num_runs = runs.size();
+    Write(out, num_fonts);
+    for (unordered_map<string, FontMetrics>::const_iterator iter = fonts.begin();
+         iter != fonts.end(); ++iter)
+    {
+      Write(out, iter->first);
+      Write(out, iter->second.ascent);
+      Write(out, iter->second.descent);
+    }
+    Write(out, num_runs);
+    for (unordered_map<string, TextRunMetrics>::const_iterator iter = runs.begin();
+         iter != runs.end(); ++iter)
+    {
+      Write(out, iter->first);
+      Write(out, iter->second.x_bearing);
+      Write(out, iter->second.width);
+      Write(out, iter->second.x_advance);
+    }
+  }))
+  {
+    cerr << "Cannot write text metrics cache " << filename << endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,65 @@
+// TextMetrics.h: Cache of font and text extents, so labels that repeat
+// within a render or across renders are only measured once
+
+#ifndef TEXTMETRICS_H
+#define TEXTMETRICS_H
+
+#include "System.h"
+
+struct FontMetrics
+{
+  double ascent, descent;
+};
+
+// The parts of cairo_text_extents_t the renderer uses, for one run of text
+// in a single style
+struct TextRunMetrics
+{
+  double x_bearing, width, x_advance;
+};
+
+// Metrics are keyed by (target, face, size, slant, weight, text).  The
+// target identifies what the text is measured for (surface type and
+// device scale), since hinting makes the same text measure differently on
+// a raster surface than in a PDF.  One cache may be shared by renders
+// running on several threads.
+class TextMetricsCache
+{
+public:
+  TextMetricsCache();
+
+  bool FindFont(const string &target, const string &face, double size,
+                FontMetrics &metrics) const;
+  void AddFont(const string &target, const string &face, double size,
+               const FontMetrics &metrics);
+
+  bool FindRun(const string &target, const string &face, double size,
+               int slant, int weight, const string &text,
+               TextRunMetrics &metrics) const;
+  void AddRun(const string &target, const string &face, double size,
+              int slant, int weight, const string &text,
+              const TextRunMetrics &metrics);
+
+  int NumHits() const { return hits; }
+  int NumMisses() const { return misses; }
+
+  // Load() quietly starts empty if the file is missing or unreadable;
+  // Save() only writes if something was added since
+  bool Load(const string &filename);
+  bool Save(const string &filename) const;
+
+private:
+  mutable mutex lock;
+  unordered_map<string, FontMetrics> fonts;
+  unordered_map<string, TextRunMetrics> runs;
+  mutable int hits, misses;
+  bool changed;
+
+  static string Key(const string &target, const string &face, double size,
+                    int slant, int weight, const string &text);
+
+  TextMetricsCache(const TextMetricsCache &);
+  TextMetricsCache &operator=(const TextMetricsCache &);
+};
+
+#endif
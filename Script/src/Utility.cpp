@@ -328,6 +328,24 @@ void WriteFile(const string &filename, const vector<string> &lines)
   f.close();
 }
 
+bool WriteFileAtomic(const string &filename,
+                     const function<void (ostream &)> &write)
+{
+  string tmp_filename = filename + "." + ToStr(getpid()) + "." +
+    ToStr(hash<thread::id>()(this_thread::get_id())) + ".tmp";
+  ofstream out(tmp_filename.c_str(), ios::binary);
+  if (!out.is_open())
+    return false;
+  write(out);
+  out.close();
+  if (out.fail() || !RenameFile(tmp_filename, filename))
+  {
+    RemoveFile(tmp_filename);
+    return false;
+  }
+  return true;
+}
+
 
 void SplitFields(const string &s, vector<string> &fields, const string &delim)
 {
@@ -84,6 +84,12 @@ void ReadFileList(const string &listfname, vector<string> &files);
 size_t GetFileSize(const string &filename);
 void ReadFile(const string &filename, vector<string> &lines, bool discard_empty = false);
 void WriteFile(const string &filename, const vector<string> &lines);
+// Writes filename through write(), into a file private to this process and
+// thread that is then renamed into place, so concurrent readers never see a
+// partial file.  Returns false, leaving filename alone, if it could not be
+// written.
+bool WriteFileAtomic(const string &filename,
+                     const function<void (ostream &)> &write);
 
 void SplitFields(const string &s, vector<string> &fields, const string &delim);
 void SplitStrictFields(const string &s, vector<string> &fields, 